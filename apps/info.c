@@ -3,11 +3,22 @@
 
 int info_main(int argc, const char *argv[])
 {
+    struct pmm_cache_stats stats;
+    unsigned int order;
 
     printf("Total memory:      %d\n", get_total_mem_b());
     printf("Available memory:  %d\n", get_free_mem_b());
     printf("Used memory:       %d\n", get_used_mem_b());
     printf("Kernel size:       %d\n", get_krnl_size());
 
+    for (order = 0; order <= PMM_CACHE_MAX_ORDER; order++)
+    {
+        if (pmm_cache_stats(order, &stats))
+            break;
+        printf("Frame cache %d:     %d/%d cached, %d hits, %d misses\n",
+                order, stats.cnt, stats.high, stats.hits, stats.misses);
+    }
+    printf("Zeroed frames:     %d\n", pmm_zero_pool_cnt());
+
     return 0;
 }
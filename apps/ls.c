@@ -1,5 +1,6 @@
 #include <libc.h>
 #include <fs/vfs.h>
+#include <shell.h>
 
 int ls_main(int argc, char **argv)
 {
@@ -12,7 +13,8 @@ int ls_main(int argc, char **argv)
 	else
 		dir = argv[1];
 
-	file_list = get_file_list(dir);
+	/* the list goes with the command's arena */
+	file_list = get_file_list(dir, shell_arena());
 	if (!file_list)
 	{
 		printf("Error retrieving file list\n");
@@ -28,7 +30,5 @@ int ls_main(int argc, char **argv)
 		printf("%s\n", file_list[i]->filename);
 	}
 
-	free(file_list);
-
 	return 0;
 }
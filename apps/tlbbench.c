@@ -0,0 +1,81 @@
+#include <libc.h>
+#include <mm.h>
+#include <x86/cpu.h>
+
+#define BENCH_PAGES 64      /* kernel pages touched after every switch */
+#define BENCH_SWITCHES 1000
+
+/*
+ * Switches between `a` and `b` and reads a word from every page of
+ * `buf` after each switch, so every non-global TLB entry is refilled.
+ * Returns the average cycle count of a round.
+ */
+static unsigned int bench(struct pd_t *a, struct pd_t *b, volatile int *buf)
+{
+    unsigned long long start;
+    unsigned int i, j;
+    int sum = 0;
+
+    start = x86_rdtsc();
+    for (i = 0; i < BENCH_SWITCHES; i++)
+    {
+        vmm_space_switch(i % 2 ? b : a);
+        for (j = 0; j < BENCH_PAGES; j++)
+            sum += buf[j * (PAGE_SIZE / sizeof(int))];
+    }
+
+    return (unsigned int) (x86_rdtsc() - start) / BENCH_SWITCHES;
+}
+
+int tlbbench_main(int argc, char **argv)
+{
+    struct pd_t *home, *other;
+    volatile int *buf;
+    unsigned int local, global;
+    size_t i;
+
+    (void) argc;
+    (void) argv;
+
+    if (!(x86_cpu_features() & X86_FEATURE_TSC))
+    {
+        printf("No time stamp counter\n");
+        return 1;
+    }
+
+    home = vmm_space_current();
+    other = vmm_space_create();
+    buf = (volatile int *) kalloc(BENCH_PAGES * PAGE_SIZE);
+    if (!other || !buf)
+    {
+        printf("Out of memory\n");
+        vmm_space_destroy(other);
+        free((void *) buf);
+        return 1;
+    }
+    /* fault every page in up front */
+    for (i = 0; i < BENCH_PAGES; i++)
+        buf[i * (PAGE_SIZE / sizeof(int))] = 0;
+
+    if (vmm_set_global_pages(false))
+    {
+        printf("Global pages are not supported\n");
+        global = local = bench(home, other, buf);
+    }
+    else
+    {
+        local = bench(home, other, buf);
+        vmm_set_global_pages(true);
+        global = bench(home, other, buf);
+    }
+    vmm_space_switch(home);
+
+    printf("Cycles per switch and %d page touches:\n", BENCH_PAGES);
+    printf("  non-global kernel pages: %d\n", local);
+    printf("  global kernel pages:     %d\n", global);
+
+    vmm_space_destroy(other);
+    free((void *) buf);
+
+    return 0;
+}
@@ -54,6 +54,62 @@ GET_AVAIL_MEM_KB:
     ret
 
 
+;------------------------------------------
+;   Collects BIOS E820 memory map.
+;       es:di => buffer for E820_MAX_ENTRIES entries, 24 bytes each
+;   Returns:
+;       ax = count of entries in the buffer, -1 on error
+;------------------------------------------
+%define E820_ENTRY_SIZE     24
+%define E820_MAX_ENTRIES    128
+%define E820_SMAP           0x534D4150  ; 'SMAP'
+
+GET_MEMORY_MAP:
+    push bp
+    mov bp, sp
+    push ebx
+    push ecx
+    push edx
+    push si
+    push di
+    xor si, si          ; entry count
+    xor ebx, ebx        ; continuation value, 0 to start from the beginning
+.NEXT_ENTRY:
+    mov eax, 0xE820
+    mov edx, E820_SMAP
+    mov ecx, E820_ENTRY_SIZE
+    mov DWORD [es:di+20], 1 ; valid ACPI 3.x attribute for 20 byte entries
+    int 0x15
+    jc  .MAP_DONE       ; unsupported on the 1st call, end of map otherwise
+    cmp eax, E820_SMAP
+    jne .ERROR
+    jcxz .SKIP_ENTRY    ; empty entry
+    mov ecx, DWORD [es:di+8]
+    or ecx, DWORD [es:di+12]
+    jz  .SKIP_ENTRY     ; zero length region
+    inc si
+    add di, E820_ENTRY_SIZE
+    cmp si, E820_MAX_ENTRIES
+    je  .MAP_DONE
+.SKIP_ENTRY:
+    or ebx, ebx         ; 0 means this was the last entry
+    jnz .NEXT_ENTRY
+.MAP_DONE:
+    mov ax, si
+    or ax, ax
+    jnz .EXIT
+.ERROR:
+    mov ax, -1
+.EXIT:
+    pop di
+    pop si
+    pop edx
+    pop ecx
+    pop ebx
+    leave
+    ret
+
+
 ;--------------------------------------------------
 ;   Puts CPU into 32-bit mode.
 ;--------------------------------------------------
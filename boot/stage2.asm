@@ -27,6 +27,7 @@ jmp STAGE2_MAIN
 ;------------------------------------
 %define KERNEL_PMODE_BASE 0xC0000000; kernel load location in protected mode
 %define KERNEL_RMODE_BASE 0x7E00    ; kernel load location in real mode
+%define MEM_MAP_SEG 0x9700          ; E820 map location (0x97000), just below FAT tables
 KernelImgName:  db "KERNEL     "    ; MUST be 11 bytes
 
 ; uninitialized data
@@ -34,6 +35,7 @@ KernelImgSizeLow: dd 0
 KernelImgSizeHigh: dd 0
 MemKBLow: dd 0
 MemKBHigh: dd 0
+MemMapCnt: dd 0
 
 FailureMsg: db 0x0D, 0x0A, "*** FATAL: KERNEL is corrupt or not in the FLOPPY.IMG.", 0x0D, 0x0A, 0x0A, 0x00
 ;------------------------------------
@@ -65,6 +67,19 @@ STAGE2_MAIN:
     mov WORD [MemKBLow], ax
     mov WORD [MemKBHigh], bx
 
+    ; Get memory map. Not fatal if BIOS can't do it -
+    ; the kernel falls back to the size above.
+    mov ax, MEM_MAP_SEG
+    mov es, ax
+    xor di, di
+    call GET_MEMORY_MAP
+    xor bx, bx
+    mov es, bx
+    cmp ax, -1
+    je .NoMemMap
+    mov WORD [MemMapCnt], ax
+.NoMemMap:
+
     ; Load the kernel while it's easy in 16-bit mode ^^  (will move after)
     push KERNEL_RMODE_BASE      ; memory offset
     push 0                      ; memory segment
@@ -139,6 +154,8 @@ STAGE3:
 
     ; and execute it!
     cli
+    push DWORD MEM_MAP_SEG * 16
+    push DWORD [MemMapCnt]
     push DWORD KERNEL_PMODE_BASE
     push DWORD [KernelImgSize]
     push DWORD [MemorySize]
@@ -468,7 +468,7 @@ static void *do_read_sector(struct chs_t *chs)
     flp_read_cmd();
     flp_read_cmd();
 
-    return (void *) flp.dma.buf;
+    return flp.dma.buf_va;
 }
 
 /*
@@ -499,7 +499,7 @@ void *floppy_read(void *buf, addr_t dev_loc, size_t cnt)
         do_read_sector(&chs);
         offset = dev_loc % SECTOR_SIZE;
         step = MIN(SECTOR_SIZE - offset, cnt);
-        memcpy(buf, (void *) (flp.dma.buf + offset), step);
+        memcpy(buf, flp.dma.buf_va + offset, step);
     }
 
     set_motor_off(WAIT_MOTOR_SPIN);
@@ -554,7 +554,11 @@ int floppy_init()
     }
 
     dma_struct_init(&flp.dma, 2);
-    dma_reg_channel(&flp.dma, SECTORS_PER_TRACK * 512);
+    if (dma_reg_channel(&flp.dma, SECTORS_PER_TRACK * 512))
+    {
+        kernel_warning("Floppy DMA buffer allocation failure");
+        return -1;
+    }
     
     ctrl_disable();
     ctrl_enable();
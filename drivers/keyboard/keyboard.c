@@ -13,6 +13,7 @@
 #include <shell.h>
 #include <x86/cpu.h>
 #include <x86/i8259.h>
+#include <workqueue.h>
 
 static int kbrd_enable();
 static int kbrd_disable();
@@ -495,6 +496,22 @@ static bool _caps_on;
 static bool _ctrl_on;
 static bool _multicode;
 
+/*
+ * Typed characters wait here for the shell.
+ * The IRQ handler is the only one moving `head` and
+ * the deferred work the only one moving `tail`.
+ */
+#define KBRD_BUF_SIZE 64
+
+static struct {
+    char c[KBRD_BUF_SIZE];
+    volatile size_t head;
+    volatile size_t tail;
+} _typed;
+
+static void pass_typed(void *data);
+static struct work_t _typed_work = WORK_INIT(pass_typed, NULL);
+
 static char get_kbrd_buffer()
 {
     return inportb(KBRD_PORT_ENCODER);
@@ -559,7 +576,29 @@ static void handle_make_code(short code)
     if (_caps_on)
         c = caps_effect(c);
 
-    shell_kbrd_cb(c);
+    /* the shell might run a whole command on it - not in the IRQ */
+    if ((_typed.head + 1) % KBRD_BUF_SIZE == _typed.tail)
+        return;
+    _typed.c[_typed.head] = c;
+    _typed.head = (_typed.head + 1) % KBRD_BUF_SIZE;
+    queue_work(&_typed_work);
+}
+
+/*
+ * Hands typed characters over to the shell.
+ */
+static void pass_typed(void *data)
+{
+    char c;
+
+    (void) data;
+
+    while (_typed.tail != _typed.head)
+    {
+        c = _typed.c[_typed.tail];
+        _typed.tail = (_typed.tail + 1) % KBRD_BUF_SIZE;
+        shell_kbrd_cb(c);
+    }
 }
 
 static void handle_break_code(short code)
@@ -4,6 +4,7 @@
 
 #include <linklist.h>
 #include <error.h>
+#include <mm.h>
 #include "fat12.h"
 #include "vfs.h"
 
@@ -53,6 +54,7 @@ struct rootdir_item
 };
 
 struct fat12_mount *fat12_mounts;
+static struct kmem_cache *fat12_mount_cache;
 
 static struct fat12_mount *get_mount_point(struct fs_driver *drv)
 {
@@ -147,7 +149,7 @@ static struct fileinfo *rootdir_to_fileinfo(struct rootdir_item *rootdir_itm, st
 	}
 
 	/* Set filename */
-	for (i = 0; rootdir_itm->filename[i] != ' '; i++)
+	for (i = 0; i < FAT12_MAX_FILENAME_LENGTH && rootdir_itm->filename[i] != ' '; i++)
 		inf->filename[i] = rootdir_itm->filename[i];
 	cur_idx = i;
 	inf->filename[cur_idx++] = '.';
@@ -169,7 +171,8 @@ static struct fileinfo *rootdir_to_fileinfo(struct rootdir_item *rootdir_itm, st
 	return inf;
 }
 
-static struct fileinfo **fs_ls(struct fs_driver *fs_drv, const char *dir)
+static struct fileinfo **fs_ls(struct fs_driver *fs_drv, const char *dir,
+                               struct arena *arena)
 {
 	struct fileinfo **files;
 	struct fat12_mount *mount;
@@ -200,39 +203,45 @@ static struct fileinfo **fs_ls(struct fs_driver *fs_drv, const char *dir)
 	if (file_cnt == 0)
 		return NULL;
 
-	files = (struct fileinfo **) kalloc(sizeof(struct fileinfo *) * (file_cnt + 1));
+	files = (struct fileinfo **) arena_alloc(arena, sizeof(struct fileinfo *) * (file_cnt + 1));
 	if (!files)
 	{
 		error = -ENOMEM;
 		return NULL;
 	}
-	for (i = 0; i < file_cnt; i++)
+	for (i = 0, j = 0; i < file_cnt; i++)
 	{
 		rootdir_itm = &(((struct rootdir_item *) mount->rootdir_data)[i]);
 		if (!(rootdir_itm->flags & HIDDEN))
 		{
-            files[i] = alloc_fileinfo();
-			if (!files[i])
+			files[j] = alloc_fileinfo(arena);
+			if (!files[j])
 			{
 				error = -ENOMEM;
 				return NULL;
 			}
 
-			if (!rootdir_to_fileinfo(rootdir_itm, files[i]))
+			if (!rootdir_to_fileinfo(rootdir_itm, files[j]))
 			{
 				printf("FAT12 ERROR: failure filling fileinfo from rootdir");
 				return NULL;
 			}
+			j++;
 		}
 	}
-	files[i+1] = NULL;
+	files[j] = NULL;
 
 	return files;
 }
 
 struct fs_driver *fat12_init_fs(struct fs_driver *driver)
 {
-	struct fat12_mount *mount = (struct fat12_mount *) kalloc(sizeof(struct fat12_mount));
+	struct fat12_mount *mount;
+
+	if (!fat12_mount_cache)
+		fat12_mount_cache = kmem_cache_create("fat12_mount",
+		                                      sizeof(struct fat12_mount), NULL);
+	mount = (struct fat12_mount *) kmem_cache_alloc(fat12_mount_cache);
 	if (!mount)
 	{
 		error = -ENOMEM;
@@ -286,6 +295,6 @@ struct fs_driver *fat12_init_fs(struct fs_driver *driver)
 	return driver;
 
 fail_return:
-	free(mount);
+	kmem_cache_free(fat12_mount_cache, mount);
 	return NULL;
 }
@@ -7,6 +7,7 @@
 #include <linklist.h>
 #include <error.h>
 #include <floppy.h>
+#include <mm.h>
 #include "vfs.h"
 
 /*
@@ -43,11 +44,28 @@ struct vfs
 
 static struct vfs _vfs;
 
+/* object caches */
+static struct kmem_cache *mount_cache;
+static struct kmem_cache *fs_driver_cache;
+static struct kmem_cache *dev_driver_cache;
+static struct kmem_cache *mountname_cache;
+
 int vfs_init()
 {
     _vfs.mount_pts = NULL;
     _vfs.dir_count = 0;
 
+    mount_cache = kmem_cache_create("mount_point",
+                                    sizeof(struct mount_point), NULL);
+    fs_driver_cache = kmem_cache_create("fs_driver",
+                                        sizeof(struct fs_driver), NULL);
+    dev_driver_cache = kmem_cache_create("dev_driver",
+                                         sizeof(struct dev_driver), NULL);
+    mountname_cache = kmem_cache_create("mount_name", MAX_MOUNTNAME_SIZE, NULL);
+    if (!mount_cache || !fs_driver_cache || !dev_driver_cache ||
+        !mountname_cache)
+        return -ENOMEM;
+
     return 0;
 }
 
@@ -62,16 +80,18 @@ int mount(enum storage_dev_type dev_type, char *filename)
         return -EBADARG;
 
     /* Create a new mount_point */
-    mount = (struct mount_point *) kalloc(sizeof(struct mount_point));
+    mount = (struct mount_point *) kmem_cache_alloc(mount_cache);
     if (!mount)
         return -ENOMEM;
-	mount->fs_driver = (struct fs_driver *) kalloc(sizeof(struct fs_driver));
+	mount->fs_driver = (struct fs_driver *) kmem_cache_alloc(fs_driver_cache);
 	if (!mount->fs_driver)
 		return -ENOMEM;
-	mount->fs_driver->dev_driver = (struct dev_driver *) kalloc(sizeof(struct dev_driver));
+	mount->fs_driver->dev_driver = (struct dev_driver *) kmem_cache_alloc(dev_driver_cache);
 	if (!mount->fs_driver->dev_driver)
 		return -ENOMEM;
-	mount->name = (char *) kalloc(MAX_MOUNTNAME_SIZE);
+	mount->name = (char *) kmem_cache_alloc(mountname_cache);
+	if (!mount->name)
+		return -ENOMEM;
 	strcpy(mount->name, filename);
 
     /* Initialize the storage driver functions */
@@ -143,30 +163,34 @@ int read(FILE *hndl, void *buf, size_t nbytes)
 	return -1;
 }
 
-struct fileinfo **get_mounts()
+struct fileinfo **get_mounts(struct arena *arena)
 {
 	struct fileinfo **inf;
 	struct mount_point *mnt_point;
 	size_t idx;
 
 	if (_vfs.dir_count == 0)
-		return inf;
+		return NULL;
 
-	inf = (struct fileinfo **) kalloc((_vfs.dir_count + 1) * sizeof(struct fileinfo *));
+	inf = (struct fileinfo **) arena_alloc(arena, (_vfs.dir_count + 1) * sizeof(struct fileinfo *));
+	if (!inf)
+		return NULL;
 
 	llist_foreach(_vfs.mount_pts, mnt_point, idx, ll)
 	{
-		inf[idx] = (struct fileinfo *) kalloc(sizeof(struct fileinfo));
+		inf[idx] = (struct fileinfo *) arena_alloc(arena, sizeof(struct fileinfo));
+		if (!inf[idx])
+			return NULL;
 		inf[idx]->filename = mnt_point->name;
 		inf[idx]->size = 0;
 		inf[idx]->flags = 0 | VOLUME_LABEL;
 	}
-	inf[idx+1] = NULL;
+	inf[idx] = NULL;
 
 	return inf;
 }
 
-static struct fileinfo **get_dev_files(char *dir)
+static struct fileinfo **get_dev_files(char *dir, struct arena *arena)
 {
 	int idx;
 	struct mount_point *mount_point;
@@ -184,13 +208,13 @@ static struct fileinfo **get_dev_files(char *dir)
 	llist_foreach(_vfs.mount_pts, mount_point, idx, ll)
 	{
 		if (strcmp(mount_point->name, mount_name) == 0)
-			return mount_point->fs_driver->ls(mount_point->fs_driver, dir_name);
+			return mount_point->fs_driver->ls(mount_point->fs_driver, dir_name, arena);
 	}
 
 	return NULL;
 }
 
-struct fileinfo **get_file_list(const char *dir)
+struct fileinfo **get_file_list(const char *dir, struct arena *arena)
 {
 	struct fileinfo **files;
 
@@ -199,26 +223,29 @@ struct fileinfo **get_file_list(const char *dir)
 
 	/* Check if root director is requested */
 	if (strcmp(dir, "/") == 0)
-		files = get_mounts();
+		files = get_mounts(arena);
 	else
 	{
 		dir++; /* get rid of slash */
-		files = get_dev_files(dir);
+		files = get_dev_files(dir, arena);
 	}
 
 	return files;
 }
 
-struct fileinfo *alloc_fileinfo()
+/*
+ * Allocates a fileinfo with room for the filename from `arena`.
+ */
+struct fileinfo *alloc_fileinfo(struct arena *arena)
 {
-	struct fileinfo *inf = (struct fileinfo *) kalloc(sizeof(struct fileinfo));
+	struct fileinfo *inf = (struct fileinfo *) arena_alloc(arena, sizeof(struct fileinfo));
 	if (!inf)
 	{
 		error = -ENOMEM;
 		return NULL;
 	}
 
-	inf->filename = (char *) kalloc(MAX_FILENAME_LENGTH);
+	inf->filename = (char *) arena_alloc(arena, MAX_FILENAME_LENGTH);
 	if (!inf->filename)
 	{
 		error = -ENOMEM;
@@ -227,12 +254,3 @@ struct fileinfo *alloc_fileinfo()
 
 	return inf;
 }
-
-void dealoc_fileinfo(struct fileinfo *inf)
-{
-	if (!inf)
-		return;
-
-	free(inf->filename);
-	free(inf);
-}
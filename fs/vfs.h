@@ -9,8 +9,11 @@
 
 #include <libc.h>
 
+struct arena;
+struct fs_driver;
+
 #define MAX_MOUNTNAME_SIZE 16
-#define MAX_FILENAME_LENGTH 12
+#define MAX_FILENAME_LENGTH 13 /* 8.3 name and the terminator */
 
 /*
  * Storage device type used when mounting.
@@ -46,7 +49,8 @@ struct dev_driver
 
 typedef char *fs_read_func_t(char *buf, size_t b_cnt);
 typedef int fs_write_func_t(/* TODO: NOT IMPLEMENTED */);
-typedef char **fs_ls_func_t(struct fs_driver *fs_drv, const char *dir);
+typedef struct fileinfo **fs_ls_func_t(struct fs_driver *fs_drv,
+                                       const char *dir, struct arena *arena);
 
 struct fs_driver
 {
@@ -95,6 +99,8 @@ struct fileinfo
 	size_t size; /* in bytes */
 };
 
+int vfs_init();
+
 /* Common I/O functions */
 int mount(enum storage_dev_type dev_type, char *filename);
 int unmount(char *filename);
@@ -102,11 +108,10 @@ FILE *open(char *filename);
 void close(FILE *hndl);
 int read(FILE *hndl, void *buf, size_t nbytes);
 
-/* Returns char array with files in directory separated by '\0'.
- * Double '\0' means the end of array. */
-struct fileinfo **get_file_list(const char *dir);
+/* Returns NULL terminated array of files in directory.
+ * The array and everything it points to is allocated from `arena`. */
+struct fileinfo **get_file_list(const char *dir, struct arena *arena);
 
-struct fileinfo *alloc_fileinfo();
-void dealoc_fileinfo(struct fileinfo *inf);
+struct fileinfo *alloc_fileinfo(struct arena *arena);
 
 #endif /* end of include guard: VFS_SWF400KO */
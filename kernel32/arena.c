@@ -0,0 +1,138 @@
+/******************************************************************************
+ *      Allocation arenas
+ *
+ *      Bump pointer allocation for short lived objects. Memory comes in
+ *      page sized chunks, an allocation just moves the chunk's top up,
+ *      and everything allocated is released at once by a reset.
+ ******************************************************************************/
+
+#include <libc.h>
+#include <error.h>
+#include "mm.h"
+
+#define ARENA_ALIGN 8
+
+#define arena_align(addr)   \
+    (((addr) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+    struct arena_chunk *next;   /* older chunk */
+    size_t pages;
+    addr_t top;     /* the first free byte */
+    addr_t end;
+};
+
+struct arena {
+    struct arena_chunk *chunk;  /* the one allocations come from */
+    size_t chunk_pages;         /* default chunk size */
+};
+
+/*
+ * Allocates a chunk big enough for at least `bytes`.
+ * Returns NULL on error.
+ */
+static struct arena_chunk *chunk_alloc(size_t pages, size_t bytes)
+{
+    struct arena_chunk *chunk;
+    size_t need = (arena_align(sizeof(struct arena_chunk)) + bytes +
+                   PAGE_SIZE - 1) / PAGE_SIZE;
+
+    pages = MAX(pages, need);
+    chunk = (struct arena_chunk *) vmm_alloc_pages(pages);
+    if (!chunk)
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->pages = pages;
+    chunk->top = arena_align((addr_t) (chunk + 1));
+    chunk->end = (addr_t) chunk + pages * PAGE_SIZE;
+
+    return chunk;
+}
+
+/*
+ * Creates an arena which grabs memory `bytes` at a time.
+ * Returns NULL on error.
+ */
+struct arena *arena_create(size_t bytes)
+{
+    struct arena *arena;
+
+    arena = (struct arena *) kalloc(sizeof(struct arena));
+    if (!arena)
+        return NULL;
+
+    arena->chunk_pages = MAX(1, (bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+    arena->chunk = chunk_alloc(arena->chunk_pages, 0);
+    if (!arena->chunk)
+    {
+        free(arena);
+        return NULL;
+    }
+
+    return arena;
+}
+
+/*
+ * Allocates `bytes` from `arena`. The memory can't be freed
+ * on its own, it goes with the next arena_reset().
+ * Returns NULL on error.
+ */
+void *arena_alloc(struct arena *arena, size_t bytes)
+{
+    struct arena_chunk *chunk;
+    addr_t addr;
+
+    if (!arena || !bytes)
+        return NULL;
+
+    chunk = arena->chunk;
+    if (bytes > chunk->end - chunk->top)
+    {
+        chunk = chunk_alloc(arena->chunk_pages, bytes);
+        if (!chunk)
+            return NULL;
+        chunk->next = arena->chunk;
+        arena->chunk = chunk;
+    }
+
+    addr = chunk->top;
+    chunk->top = MIN(arena_align(addr + bytes), chunk->end);
+
+    return (void *) addr;
+}
+
+/*
+ * Releases everything allocated from `arena`.
+ * The very first chunk is kept for the allocations to come.
+ */
+void arena_reset(struct arena *arena)
+{
+    struct arena_chunk *chunk;
+
+    if (!arena)
+        return;
+
+    while ((chunk = arena->chunk)->next)
+    {
+        arena->chunk = chunk->next;
+        vmm_free_pages(chunk, chunk->pages);
+    }
+    chunk->top = arena_align((addr_t) (chunk + 1));
+}
+
+/*
+ * Releases `arena` with all its memory.
+ */
+void arena_destroy(struct arena *arena)
+{
+    struct arena_chunk *chunk;
+
+    if (!arena)
+        return;
+
+    arena_reset(arena);
+    chunk = arena->chunk;
+    vmm_free_pages(chunk, chunk->pages);
+    free(arena);
+}
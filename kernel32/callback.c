@@ -1,32 +1,141 @@
-#include <linklist.h>
+/******************************************************************************
+ *      Callback subsystem
+ *
+ *      Pending callbacks sit on a hierarchical timer wheel. Every level
+ *      has WHEEL_SIZE slots, a slot of level 0 spans a millisecond and
+ *      a slot of every next level spans a whole turn of the level below.
+ *      A callback goes to the lowest level whose turn still reaches its
+ *      deadline. Whenever a level wraps, the next slot of the level above
+ *      is cascaded down, so a callback only moves a few times before it
+ *      ends up in level 0 and fires. Insert and removal are O(1), a tick
+ *      runs just the callbacks due on it.
+ ******************************************************************************/
+
+#include <libc.h>
 #include "callback.h"
 #include "mm.h"
 
-static struct callback_t *cb_list = NULL;
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << (WHEEL_BITS))      /* slots per level */
+#define WHEEL_MASK ((WHEEL_SIZE) - 1)
+#define WHEEL_LEVELS 5                      /* 1ms, 64ms, 4s, 4.5min, 4.6h */
+/* the longest delay the wheel can hold, about 12 days */
+#define WHEEL_MAX_DELAY ((1UL << ((WHEEL_BITS) * (WHEEL_LEVELS))) - 1)
+
+#define wheel_idx(t, lvl)   \
+    (((t) >> ((WHEEL_BITS) * (lvl))) & (WHEEL_MASK))
+
+struct callback_t {
+    struct callback_t *next;
+    struct callback_t **pprev;  /* NULL if it isn't on the wheel */
+    enum cb_type type;
+    milis_t expires;
+    milis_t delay;
+    cb_func_t *callback;
+    void *data;         /* passed to `callback` */
+};
+
+static struct {
+    struct callback_t *slot[WHEEL_LEVELS][WHEEL_SIZE];
+    milis_t jiffies;    /* the next tick to be run */
+} wheel;
 
-int register_callback(enum cb_type type,
-        struct time_t *delay, cb_func_t *callback)
+static struct kmem_cache *cb_cache = NULL;
+/* the callback which is being called right now */
+static struct callback_t *running = NULL;
+static bool running_removed = false;
+
+/*
+ * Puts `cb` into the slot of its deadline.
+ */
+static void wheel_add(struct callback_t *cb)
 {
-    struct callback_t *cb =
-        (struct callback_t *) kalloc(sizeof(struct callback_t));
-    if (!cb)
-        return -1;
+    milis_t delta = cb->expires - wheel.jiffies;
+    struct callback_t **slot;
+    size_t lvl;
 
-    cb->reg_time = get_cur_milis();
-    cb->delay = time_to_milis(delay);
-    cb->callback = callback;
-    cb->type = type;
+    if ((long) delta < 0)
+    {
+        /* already late - runs on the next tick */
+        cb->expires = wheel.jiffies;
+        delta = 0;
+    }
+    else if (delta > WHEEL_MAX_DELAY)
+    {
+        cb->expires = wheel.jiffies + WHEEL_MAX_DELAY;
+        delta = WHEEL_MAX_DELAY;
+    }
 
-    /* create a new linklist if none exist */
-    if (!cb_list)
+    for (lvl = 0; lvl < WHEEL_LEVELS - 1 &&
+                  delta >= (1UL << (WHEEL_BITS * (lvl + 1))); lvl++)
+        ;
+
+    slot = &wheel.slot[lvl][wheel_idx(cb->expires, lvl)];
+    cb->next = *slot;
+    if (*slot)
+        (*slot)->pprev = &cb->next;
+    cb->pprev = slot;
+    *slot = cb;
+}
+
+/*
+ * Takes `cb` off the wheel.
+ */
+static void wheel_del(struct callback_t *cb)
+{
+    *cb->pprev = cb->next;
+    if (cb->next)
+        cb->next->pprev = cb->pprev;
+    cb->next = NULL;
+    cb->pprev = NULL;
+}
+
+/*
+ * Moves every callback of slot `idx` of level `lvl` a level down.
+ */
+static void cascade(size_t lvl, size_t idx)
+{
+    struct callback_t *cb, *next;
+
+    cb = wheel.slot[lvl][idx];
+    wheel.slot[lvl][idx] = NULL;
+    for (; cb; cb = next)
     {
-        llist_init(cb, ll);
-        cb_list = cb;
+        next = cb->next;
+        wheel_add(cb);
     }
-    else
-        llist_add_before(cb_list, cb, ll);
+}
 
-    return 0;
+/*
+ * Registers `callback` to be called with `data` after `delay`.
+ * Returns a handle for remove_callback() or NULL on error.
+ * A one-shot callback's handle is gone once it fired.
+ */
+struct callback_t *register_callback(enum cb_type type,
+        struct time_t *delay, cb_func_t *callback, void *data)
+{
+    struct callback_t *cb;
+
+    if (!cb_cache)
+    {
+        cb_cache = kmem_cache_create("callback", sizeof(struct callback_t), NULL);
+        if (!cb_cache)
+            return NULL;
+        wheel.jiffies = get_uptime_milis();
+    }
+    cb = (struct callback_t *) kmem_cache_alloc(cb_cache);
+    if (!cb)
+        return NULL;
+
+    /* a repeating callback has to move forward at least a tick */
+    cb->delay = MAX(time_to_milis(delay), 1);
+    cb->expires = get_uptime_milis() + cb->delay;
+    cb->callback = callback;
+    cb->data = data;
+    cb->type = type;
+    wheel_add(cb);
+
+    return cb;
 }
 
 /*
@@ -35,45 +144,108 @@ int register_callback(enum cb_type type,
  */
 int remove_callback(struct callback_t *cb)
 {
-    if (!llist_is_in_list(cb, ll))
+    if (!cb)
+        return -1;
+    /* it's freed once its function returns */
+    if (cb == running)
+    {
+        running_removed = true;
+        return 0;
+    }
+    if (!cb->pprev)
         return -1;
 
-    llist_delete(cb, ll);
-    if (llist_is_empty(cb_list, ll))
-        cb_list = NULL;
-    free(cb);
+    wheel_del(cb);
+    kmem_cache_free(cb_cache, cb);
     return 0;
 }
 
 /*
- * Checks callbacks and executes the ones which is time to trigger.
- * Depending on the type of callback, after the callback function
- * returns, the entry is removed from entry or rescheduled for repeat.
+ * Runs the wheel up to the current time and executes the callbacks
+ * which are due. Depending on the type of callback, after the
+ * callback function returns, the entry is removed or rescheduled
+ * for repeat. Ticks which were missed are run one after another.
  */
 void check_callbacks()
 {
-    struct callback_t tmp;
-    struct callback_t *cb = &tmp;
-    size_t idx;
-    milis_t cur_milis;
+    struct callback_t *cb, *expired;
+    milis_t now;
+    size_t idx, lvl;
 
-    if (!cb_list)
+    if (!cb_cache)
         return;
 
-    cur_milis = get_cur_milis();
-
-    llist_foreach(cb_list, cb, idx, ll)
+    now = get_uptime_milis();
+    while ((long) (now - wheel.jiffies) >= 0)
     {
-        /* if time to trigger the callback */
-        if (cb->reg_time + cb->delay <= cur_milis)
+        idx = wheel_idx(wheel.jiffies, 0);
+        /* every level which wrapped pulls down a slot from the one above */
+        for (lvl = 1; lvl < WHEEL_LEVELS && !wheel_idx(wheel.jiffies, lvl - 1); lvl++)
+            cascade(lvl, wheel_idx(wheel.jiffies, lvl));
+        wheel.jiffies++;
+
+        /*
+         * Take the whole slot off the wheel first. A re-armed or a newly
+         * registered callback might hash into the very same slot and
+         * would be run over and over in this pass otherwise.
+         */
+        expired = wheel.slot[0][idx];
+        wheel.slot[0][idx] = NULL;
+        if (expired)
+            expired->pprev = &expired;
+
+        while ((cb = expired))
         {
-            /* call the callback */
-            cb->callback(NULL);
-            /* if the callback type is to repeat, re-register it */
-            if (cb->type == CALLBACK_REPEAT)
-                cb->reg_time = cur_milis;
+            wheel_del(cb);
+
+            running = cb;
+            running_removed = false;
+            cb->callback(cb->data);
+            running = NULL;
+
+            if (cb->type == CALLBACK_REPEAT && !running_removed)
+            {
+                /* keep the schedule even if this tick is run late */
+                cb->expires += cb->delay;
+                wheel_add(cb);
+            }
             else
-                remove_callback(cb);
+                kmem_cache_free(cb_cache, cb);
         }
     }
 }
+
+/*
+ * Finds the earliest uptime the wheel has to run at - either a
+ * callback is due or a slot of a higher level has to be cascaded,
+ * which might make a callback due a bit later.
+ * Returns false if there are no callbacks at all.
+ */
+bool callback_next_event(milis_t *when)
+{
+    milis_t at, span, found = 0;
+    bool any = false;
+    size_t lvl, k;
+
+    for (lvl = 0; lvl < WHEEL_LEVELS; lvl++)
+    {
+        /* the ticks this level's slots are run or cascaded on */
+        span = 1UL << (WHEEL_BITS * lvl);
+        at = (wheel.jiffies + span - 1) & ~(span - 1);
+        for (k = 0; k < WHEEL_SIZE; k++, at += span)
+        {
+            if (any && (long) (at - found) >= 0)
+                break;
+            if (wheel.slot[lvl][wheel_idx(at, lvl)])
+            {
+                found = at;
+                any = true;
+                break;
+            }
+        }
+    }
+
+    if (any)
+        *when = found;
+    return any;
+}
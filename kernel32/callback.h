@@ -8,7 +8,6 @@
 #define CALLBACK_1JKP8FFQ
 
 #include <time.h>
-#include <linklist.h>
 
 enum cb_type {
     CALLBACK_ONE_SHOT,   /* fires once and gets deleted from the list */
@@ -17,17 +16,13 @@ enum cb_type {
 
 typedef void cb_func_t(void *);
 
-struct callback_t {
-    struct llist_t ll;
-    enum cb_type type;
-    milis_t reg_time;
-    milis_t delay;
-    cb_func_t *callback;
-};
+/* handle of a registered callback */
+struct callback_t;
 
-int register_callback(enum cb_type type,
-        struct time_t *delay, cb_func_t *callback);
+struct callback_t *register_callback(enum cb_type type,
+        struct time_t *delay, cb_func_t *callback, void *data);
 int remove_callback(struct callback_t *cb);
 void check_callbacks();
+bool callback_next_event(milis_t *when);
 
 #endif /* end of include guard: CALLBACK_1JKP8FFQ */
@@ -6,6 +6,7 @@
 
 #include <libc.h>
 #include <x86/cpu.h>
+#include <x86/i8253.h>
 #include <x86/i8259.h>
 #include <x86/cmos.h>
 #include <fs/vfs.h>
@@ -13,6 +14,7 @@
 #include "time.h"
 #include "shell.h"
 #include "linklist.h"
+#include "workqueue.h"
 
 static int screen_init()
 {
@@ -24,18 +26,126 @@ static int screen_init()
     return 0;
 }
 
+/*
+ * Idle time goes to deferred work, to reclaiming memory when it runs
+ * low and to zeroing frames, the CPU sleeps once there is nothing
+ * left to do.
+ */
 static void os_loop()
 {
     while (1)
     {
-        __asm__ __volatile__ ("sti\n"
-                              "hlt\n"
-                            : : : "memory");
+        run_work();
+        if (reclaim_idle() || pmm_zero_refill())
+            continue;
+        i8253_idle();
     }
 }
 
 struct boot_info *binfo;
 
+/*
+ * Physical memory which is in use since boot,
+ * whatever memory map says about it.
+ */
+static const range_t boot_reserved_mem[] = {
+    { 0x0, 0x8000 },        /* real mode IVT, BDA and STAGE2 */
+    { 0x8F000, 0x90000 },   /* STAGE2 stack - kmain's frame and boot_info */
+    { 0x97000, 0x9F000 },   /* E820 map, boot PD and PTs */
+    { 0x100000, 0x500000 }  /* kernel, PMM bitmaps, kernel PTs and stack */
+};
+
+/*
+ * Returns KB count of physical address space the PMM has to cover.
+ */
+static unsigned int mem_map_top_kb(struct boot_info *bi)
+{
+    unsigned long long top = 0;
+    unsigned long long end;
+    size_t i;
+
+    /* no memory map - E801 counts KBs above the 1st MB */
+    if (!bi->mmap_cnt)
+        return bi->mem_size + MB_TO_KB(1);
+
+    for (i = 0; i < bi->mmap_cnt; i++)
+    {
+        if (bi->mmap[i].type != MMAP_USABLE)
+            continue;
+        end = bi->mmap[i].base + bi->mmap[i].len;
+        if (end > top)
+            top = end;
+    }
+
+    /* 32-bit physical address space only */
+    if (top > UINT_MAX)
+        top = UINT_MAX;
+
+    return top >> 10;
+}
+
+/*
+ * Registers a [from, to) range of physical memory to the PMM
+ * with the range shrunk to whole blocks.
+ */
+static void mem_range_register(unsigned long long from, unsigned long long to,
+                               bool usable)
+{
+    if (from >= UINT_MAX)
+        return;
+    if (to > UINT_MAX)
+        to = UINT_MAX;
+
+    if (usable)
+    {
+        from = (from + 0xFFF) & ~0xFFFULL;
+        to &= ~0xFFFULL;
+    }
+    if (from >= to)
+        return;
+
+    if (usable)
+        pmm_init_region(from, to - from);
+    else
+        pmm_deinit_region(from, to - from);
+}
+
+/*
+ * Gives usable physical memory to the PMM according to
+ * BIOS memory map.
+ */
+static void mem_map_init(struct boot_info *bi)
+{
+    struct mmap_entry *entry;
+    size_t i;
+
+    if (!bi->mmap_cnt)
+    {
+        /* without the map the best guess is all above the 1st MB */
+        mem_range_register(MB_TO_BYTE(1), KB_TO_BYTE(mem_map_top_kb(bi)), true);
+    }
+    else
+    {
+        for (i = 0; i < bi->mmap_cnt; i++)
+        {
+            entry = &bi->mmap[i];
+            if (entry->type == MMAP_USABLE)
+                mem_range_register(entry->base, entry->base + entry->len, true);
+        }
+        /* the map might have overlapping entries - holes win */
+        for (i = 0; i < bi->mmap_cnt; i++)
+        {
+            entry = &bi->mmap[i];
+            if (entry->type != MMAP_USABLE)
+                mem_range_register(entry->base, entry->base + entry->len, false);
+        }
+    }
+
+    for (i = 0; i < ARRAY_LENGTH(boot_reserved_mem); i++)
+        mem_range_register(boot_reserved_mem[i].from,
+                           boot_reserved_mem[i].to, false);
+}
+
 /* Kernel entry point */
 int kmain(struct boot_info bi)
 {
@@ -58,17 +168,18 @@ int kmain(struct boot_info bi)
     if (x86_init())
         kernel_panic("x86 init error");
 
-    /* init PMM */
+    /* init PMM, its tables leave room for VMM's and the stack */
+    addr_t tables_end = KRNL_BOOT_VA_END - KRNL_STACK_SIZE;
     addr_t pmm_tbl_loc = binfo->krnl_loc + KB_TO_BYTE(binfo->krnl_size);
-    addr_t pmm_end = pmm_init(binfo->mem_size, pmm_tbl_loc);
-    /* first 5MB reserved in boot loader */
-    int mem_avail_begin = MB_TO_BYTE(5);
-    int mem_avail_end = KB_TO_BYTE(binfo->mem_size);
-    pmm_init_region(mem_avail_begin, mem_avail_end - mem_avail_begin);
+    addr_t pmm_end = pmm_init(mem_map_top_kb(binfo), pmm_tbl_loc,
+                              tables_end - vmm_init_size());
+    mem_map_init(binfo);
     set_krnl_size(binfo->krnl_size * 512);
+    if (get_total_mem_b() < KB_TO_BYTE((unsigned long long) mem_map_top_kb(binfo)))
+        kernel_warning("Not all of the memory fits the PMM tables.");
 
     /* init VMM */
-    if (vmm_init(binfo->mem_size, pmm_end))
+    if (vmm_init(binfo->mem_size, pmm_end, tables_end))
         kernel_panic("VMM init error");
 
     /* Driver initialization */
@@ -79,6 +190,8 @@ int kmain(struct boot_info bi)
     if (kbrd_init())
         kernel_warning("Keyboard initialization failure.");
 
+	if (vfs_init())
+		kernel_panic("VFS init error");
 	if (mount(STORAGE_DEVICE_FLOPPY, "floppy"))
 		kernel_warning("Floppy mount failure");
 
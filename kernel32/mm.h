@@ -3,25 +3,211 @@
 
 #include <libc.h>
 
+/* BIOS E820 memory map entry types */
+enum mmap_type {
+    MMAP_USABLE = 1,
+    MMAP_RESERVED,
+    MMAP_ACPI_RECLAIMABLE,
+    MMAP_ACPI_NVS,
+    MMAP_BAD
+};
+
+/* BIOS E820 memory map entry */
+struct mmap_entry {
+    unsigned long long base;
+    unsigned long long len;
+    unsigned int type;
+    unsigned int acpi_attr;
+} __attribute__((__packed__));
+
 struct boot_info {
     unsigned int mem_size;
     unsigned int krnl_size;
     unsigned int krnl_loc;
+    unsigned int mmap_cnt;      /* 0 if BIOS has no E820 support */
+    struct mmap_entry *mmap;
 } __attribute__((__packed__));
 
+#define PAGE_SIZE 4096
+
+/*
+ * The boot page table maps 4MB of kernel VA. The kernel image, PMM
+ * and VMM tables are laid out from its start, the stack grows down
+ * from its end.
+ */
+#define KRNL_BOOT_VA_END 0xC0400000
+#define KRNL_STACK_SIZE (KB_TO_BYTE(64))
+
 /* PMM */
-addr_t pmm_init(unsigned int mem_kb, addr_t bitmap_loc);
+#define PMM_MAX_ORDER 10    /* 2^10 blocks - 4MB */
+#define PMM_ORDER_CNT ((PMM_MAX_ORDER) + 1)
+#define PMM_CACHE_MAX_ORDER 3   /* orders which go through the area cache */
+#define PMM_CACHE_SIZE 64       /* max cached areas per order */
+
+/* Physical memory zones */
+#define ZONE_DMA_LIMIT (MB_TO_BYTE(16))     /* ISA DMA reaches 24 address bits */
+#define ZONE_DMA_BOUNDARY (KB_TO_BYTE(64))  /* ISA DMA can't cross 64KB */
+
+enum mem_zone {
+    ZONE_DMA,       /* below ZONE_DMA_LIMIT */
+    ZONE_NORMAL,    /* everything above */
+    ZONE_CNT
+};
+
+struct pmm_cache_stats {
+    unsigned int hits;      /* allocations served from the cache */
+    unsigned int misses;    /* allocations which found the cache empty */
+    unsigned int refills;   /* batch refills from the buddy allocator */
+    unsigned int drains;    /* batch drains to the buddy allocator */
+    size_t cnt;             /* currently cached areas */
+    size_t low;
+    size_t high;
+};
+
+/*
+ * Page frame database entry.
+ * There is one per physical block, indexed by the block number.
+ */
+struct page {
+    unsigned short count;   /* references, 0 if the frame is free */
+    unsigned char zone;     /* enum mem_zone */
+    unsigned char flags;    /* enum page_flag */
+    unsigned int owner;     /* owner tag, 0 if nobody claimed it */
+};
+
+/* pmm_alloc_page() flags */
+enum pmm_alloc_flag {
+    PMM_ZERO = 0x1          /* the frame has to be zeroed */
+};
+
+enum page_flag {
+    PAGE_RESERVED = 0x01,   /* not usable memory or in use since boot */
+    PAGE_DIRTY    = 0x02,   /* content differs from its backing store */
+    PAGE_LOCKED   = 0x04,   /* under I/O, don't touch */
+    PAGE_PINNED   = 0x08,   /* must never be reclaimed */
+    PAGE_SLAB     = 0x10    /* slab memory, owner is the slab */
+};
+
+addr_t pmm_init(unsigned int mem_kb, addr_t bitmap_loc, addr_t bitmap_end);
 int pmm_init_region(unsigned int addr, size_t size);
+int pmm_deinit_region(unsigned int addr, size_t size);
 extern void *pmm_alloc(unsigned int bytes);
+int pmm_dealloc(unsigned int addr, size_t size);
+void *pmm_alloc_order(unsigned int order);
+void *pmm_alloc_zone(unsigned int order, enum mem_zone zone);
+void *pmm_alloc_dma(size_t bytes);
+int pmm_free_order(void *addr, unsigned int order);
+void *pmm_alloc_page(unsigned int flags);
+bool pmm_zero_refill();
+size_t pmm_zero_pool_cnt();
+int pmm_cache_tune(unsigned int order, size_t low, size_t high);
+int pmm_cache_stats(unsigned int order, struct pmm_cache_stats *stats);
+struct page *pa_to_page(addr_t pa);
+addr_t page_to_pa(struct page *page);
+int page_get(struct page *page);
+int page_put(struct page *page);
 size_t get_total_mem_b();
 size_t get_free_mem_b();
 size_t get_used_mem_b();
 size_t get_krnl_size();
 
+/* Virtual address space allocator */
+struct va_node;
+
+struct va_space {
+    struct va_node *root;   /* free ranges */
+    struct va_node *areas;  /* areas backed on the first touch */
+    addr_t from;
+    addr_t to;
+    size_t free_pages;
+};
+
+int va_init();
+int va_space_init(struct va_space *vs, addr_t from, addr_t to);
+void va_space_destroy(struct va_space *vs);
+int va_space_clone(struct va_space *dst, struct va_space *src);
+addr_t va_alloc(struct va_space *vs, size_t pages);
+int va_free(struct va_space *vs, addr_t va, size_t pages);
+int va_reserve(struct va_space *vs, addr_t va, size_t pages);
+int vma_add(struct va_space *vs, addr_t va, size_t pages);
+size_t vma_del(struct va_space *vs, addr_t va);
+int vma_contains(struct va_space *vs, addr_t va);
+size_t vma_size(struct va_space *vs, addr_t va);
+int vma_resize(struct va_space *vs, addr_t va, size_t pages);
+addr_t vma_find(struct va_space *vs, addr_t va, size_t *pages);
+
 /* VMM */
-int vmm_init(size_t mem_kb, addr_t krnl_bin_end);
+int vmm_init(size_t mem_kb, addr_t krnl_bin_end, addr_t tables_end);
+size_t vmm_init_size();
 void free(void *ptr);
 void *kalloc(size_t bytes);
 void *malloc(size_t bytes);
+void *krealloc(void *ptr, size_t bytes);
+void *realloc(void *ptr, size_t bytes);
+void *vmm_map_phys(addr_t pa, size_t bytes);
+void vmm_unmap_phys(void *va, size_t bytes);
+void *vmm_alloc_pages(size_t cnt);
+int vmm_free_pages(void *va, size_t cnt);
+addr_t vmm_va_to_pa(void *va);
+int vmm_page_fault(addr_t va, unsigned int err);
+int vmm_set_global_pages(bool enable);
+void *phys_to_virt(addr_t pa);
+addr_t virt_to_phys(void *va);
+size_t vmm_reclaim(size_t pages, size_t scan);
+
+/* Address spaces */
+struct pd_t;
+
+struct pd_t *vmm_space_create();
+struct pd_t *vmm_space_clone();
+int vmm_space_destroy(struct pd_t *pd);
+int vmm_space_switch(struct pd_t *pd);
+struct pd_t *vmm_space_current();
+
+/* Slab allocator */
+#define KMALLOC_MIN_SIZE 16     /* smallest size class */
+#define KMALLOC_MAX_SIZE 2048   /* biggest size class */
+
+struct kmem_cache;
+typedef void kmem_ctor_t(void *obj);
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     kmem_ctor_t *ctor);
+int kmem_cache_destroy(struct kmem_cache *cache);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+int kmem_cache_free(struct kmem_cache *cache, void *obj);
+size_t kmem_cache_shrink(struct kmem_cache *cache);
+size_t kmem_shrink_all(size_t pages);
+void *kmem_alloc(size_t bytes);
+int kmem_free(void *obj);
+size_t kmem_size(void *obj);
+
+/* Allocation arenas */
+struct arena;
+
+struct arena *arena_create(size_t bytes);
+void *arena_alloc(struct arena *arena, size_t bytes);
+void arena_reset(struct arena *arena);
+void arena_destroy(struct arena *arena);
+
+/* Page reclaim */
+typedef size_t shrink_func_t(size_t pages);
+
+/*
+ * A cache which can give memory back under pressure.
+ * `shrink` releases up to `pages` pages and returns how many it did.
+ * It's called with interrupts enabled and has to disable them around
+ * every step which touches state an interrupt could change as well.
+ */
+struct shrinker {
+    const char *name;
+    shrink_func_t *shrink;
+    struct shrinker *next;
+};
+
+void register_shrinker(struct shrinker *shrinker);
+int unregister_shrinker(struct shrinker *shrinker);
+size_t reclaim_pages(size_t pages);
+bool reclaim_idle();
 
 #endif /* end of include guard: MM_ZPVRK7R1 */
@@ -6,10 +6,12 @@
 
 #include <libc.h>
 #include <error.h>
+#include <x86/cpu.h>
 #include "mm.h"
 
 #define BLOCK_SIZE 4096 /* same size as VMM block size */
-#define BITMAP_BIT_CNT CHAR_BIT
+#define BITMAP_BIT_CNT INT_BIT
+#define BITMAP_LVL_MAX 5 /* 32^5 bits is more than 4GB worth of blocks */
 
 /* conversion macros */
 #define MEM_TO_BLOCK_IDX(b) \
@@ -17,7 +19,7 @@
 #define MEM_TO_BLOCK_OFFSET(b)  \
     ((b) % BLOCK_SIZE )
 #define SIZE_KB_TO_BLOCKS(kb)   \
-    ((kb) * 1024 / BLOCK_SIZE)
+    ((kb) / (BLOCK_SIZE / 1024))
 #define SIZE_B_TO_BLOCKS(b) \
     ((b) / BLOCK_SIZE + ((b) % BLOCK_SIZE != 0 ? 1 : 0))
 
@@ -27,6 +29,8 @@
     ((b_idx) % BITMAP_BIT_CNT)
 #define BITMAP_IDX_TO_BLOCK_IDX(block_idx)  \
     ((block_idx) * BITMAP_BIT_CNT)
+#define BITS_TO_BITMAP_WORDS(bits)  \
+    ((bits) / BITMAP_BIT_CNT + ((bits) % BITMAP_BIT_CNT != 0 ? 1 : 0))
 
 #define BLOCK_TO_MEM(idx)   \
     ((void *)((idx) * BLOCK_SIZE))
@@ -36,108 +40,585 @@ enum ALIGN {
     ALIGN_HIGH
 };
 
+/*
+ * Hierarchical bitmap.
+ * Level 0 has a bit per block which is set if the block is free.
+ * Every next level has a bit per word of the level below, which is set
+ * if that word has at least one bit set. The top level is a single word,
+ * so a free block is found with one `bsf` per level.
+ */
+struct pmm_bitmap {
+    unsigned int *lvl[BITMAP_LVL_MAX];
+    size_t lvl_words[BITMAP_LVL_MAX];
+    size_t lvl_cnt;
+    size_t bit_cnt;
+};
+
 struct pmm_t {
     unsigned int block_cnt;
     unsigned int blocks_free;
     size_t krnl_size;
+    range_t zones[ZONE_CNT]; /* block index ranges */
 };
 
 static struct pmm_t pmm;
-static unsigned char *mem_bitmap;
+/* per block free/used state */
+static struct pmm_bitmap mem_bitmap;
+/*
+ * Buddy allocator free areas.
+ * Bit `i` of `order_map[n]` is set if the 2^n blocks starting
+ * from block `i << n` are free and are not merged into a bigger area.
+ */
+static struct pmm_bitmap order_map[PMM_ORDER_CNT];
 
 /*
- * Initializes PMM.
- * Returns the end of mem_bitmap array
+ * Free area cache.
+ * A LIFO stack of recently freed areas per small order, so the common
+ * alloc/free is a pop/push. Cached areas stay marked as used in the
+ * bitmaps, but are counted as free memory.
+ * The stack is refilled from the buddy allocator up to `low` entries
+ * when it runs empty and drained back down to `low` entries when it
+ * grows above `high`. Zero `low` and `high` turns the cache off.
  */
-addr_t pmm_init(unsigned int mem_kb, addr_t bitmap_loc)
+struct pmm_cache {
+    unsigned int area[PMM_CACHE_SIZE]; /* first block indexes */
+    size_t cnt;
+    size_t low;
+    size_t high;
+    struct pmm_cache_stats stats;
+};
+
+static struct pmm_cache area_cache[PMM_CACHE_MAX_ORDER + 1];
+
+/* page frame database, one entry per block */
+static struct page *pages;
+
+/* default low/high watermarks per order */
+static const size_t cache_watermarks[PMM_CACHE_MAX_ORDER + 1][2] = {
+    { 16, 48 },
+    { 8, 24 },
+    { 4, 12 },
+    { 2, 6 }
+};
+
+/*
+ * Pre-zeroed frame pool.
+ * Frames are zeroed ahead of time by pmm_zero_refill() from the idle
+ * loop, so a PMM_ZERO allocation is just a pop. Pooled frames are
+ * allocated as far as the rest of the PMM is concerned and all of
+ * them are reachable through the direct map.
+ */
+#define ZERO_POOL_SIZE 64
+#define ZERO_POOL_BATCH 4       /* frames zeroed per refill call */
+#define ZERO_POOL_RESERVE 256   /* free blocks the pool never takes */
+
+static struct {
+    addr_t frame[ZERO_POOL_SIZE];
+    size_t cnt;
+} zero_pool;
+
+static size_t zero_pool_shrink(size_t cnt);
+static struct shrinker zero_pool_shrinker = {
+    .name = "zero pool",
+    .shrink = zero_pool_shrink
+};
+
+/*
+ * Returns the index of the lowest set bit in `val`.
+ * `val` must not be 0.
+ */
+static inline unsigned int bit_scan_forward(unsigned int val)
 {
-    /* on init set all memory as reservered */
-    mem_bitmap = (unsigned char *) bitmap_loc;
-    memset(mem_bitmap, 0xFF, SIZE_KB_TO_BLOCKS(mem_kb) / BITMAP_BIT_CNT);
-    pmm.block_cnt = SIZE_KB_TO_BLOCKS(mem_kb);
-    pmm.blocks_free = 0;
-    pmm.krnl_size = 0;
+    unsigned int idx;
+
+    __asm__ ("bsfl %1, %0" : "=r" (idx) : "rm" (val));
 
-    return ((addr_t) mem_bitmap) + (pmm.block_cnt / BITMAP_BIT_CNT) + INT_BIT;
+    return idx;
 }
 
-static void set_bit(size_t idx)
+/*
+ * Lays out a bitmap of `bits` size with all its summary levels at `loc`.
+ * Everything is marked as not set.
+ * Returns the end of the bitmap.
+ */
+static addr_t bitmap_init(struct pmm_bitmap *bm, size_t bits, addr_t loc)
 {
-    size_t map_idx, bit_idx;
+    size_t words;
+
+    bm->bit_cnt = bits;
+    bm->lvl_cnt = 0;
+    do {
+        words = BITS_TO_BITMAP_WORDS(bits);
+        bm->lvl[bm->lvl_cnt] = (unsigned int *) loc;
+        bm->lvl_words[bm->lvl_cnt] = words;
+        memset(bm->lvl[bm->lvl_cnt], 0, words * INT_BYTE);
 
-    map_idx = BLOCK_IDX_TO_BITMAP_IDX(idx);
-    bit_idx = BLOCK_IDX_TO_BIT_OFFSET(idx);
+        loc += words * INT_BYTE;
+        bits = words;
+        bm->lvl_cnt++;
+    } while (words > 1 && bm->lvl_cnt < BITMAP_LVL_MAX);
 
-    mem_bitmap[map_idx] = SET_BIT(mem_bitmap[map_idx], bit_idx);
+    return loc;
 }
 
-static void unset_bit(size_t idx)
+static inline int bitmap_test(struct pmm_bitmap *bm, size_t idx)
 {
-    size_t map_idx, bit_idx;
+    return (bm->lvl[0][BLOCK_IDX_TO_BITMAP_IDX(idx)] >>
+                BLOCK_IDX_TO_BIT_OFFSET(idx)) & 1;
+}
 
-    map_idx = BLOCK_IDX_TO_BITMAP_IDX(idx);
-    bit_idx = BLOCK_IDX_TO_BIT_OFFSET(idx);
+static void bitmap_set(struct pmm_bitmap *bm, size_t idx)
+{
+    size_t lvl;
+    unsigned int *word;
+    unsigned int old;
 
-    mem_bitmap[map_idx] = UNSET_BIT(mem_bitmap[map_idx], bit_idx);
+    for (lvl = 0; lvl < bm->lvl_cnt; lvl++, idx = BLOCK_IDX_TO_BITMAP_IDX(idx))
+    {
+        word = &bm->lvl[lvl][BLOCK_IDX_TO_BITMAP_IDX(idx)];
+        old = *word;
+        *word = SET_BIT(old, BLOCK_IDX_TO_BIT_OFFSET(idx));
+        /* the level above already knows this word is not empty */
+        if (old)
+            break;
+    }
 }
 
-inline static int is_map_idx_full(unsigned int idx)
+static void bitmap_unset(struct pmm_bitmap *bm, size_t idx)
 {
-    return mem_bitmap[idx] == 0xFF;
+    size_t lvl;
+    unsigned int *word;
+
+    for (lvl = 0; lvl < bm->lvl_cnt; lvl++, idx = BLOCK_IDX_TO_BITMAP_IDX(idx))
+    {
+        word = &bm->lvl[lvl][BLOCK_IDX_TO_BITMAP_IDX(idx)];
+        *word = UNSET_BIT(*word, BLOCK_IDX_TO_BIT_OFFSET(idx));
+        /* the level above has to know only when the word gets empty */
+        if (*word)
+            break;
+    }
 }
 
-static unsigned int get_free_bit(char val)
+/*
+ * Returns the index of the first set bit at or after `idx`,
+ * or -1 if there is none.
+ */
+static int bitmap_find_from(struct pmm_bitmap *bm, size_t idx)
 {
-    int i;
+    size_t lvl, word_idx;
+    unsigned int word;
 
-    for (i = 0; i < BITMAP_BIT_CNT; i++)
-        if (IS_BIT_SET(val, i))
-            return i;
-    return -1;
+    /* climb up until some level has a set bit at or after `idx` */
+    for (lvl = 0; lvl < bm->lvl_cnt; lvl++)
+    {
+        word_idx = BLOCK_IDX_TO_BITMAP_IDX(idx);
+        if (word_idx >= bm->lvl_words[lvl])
+            return -1;
+
+        word = bm->lvl[lvl][word_idx] & (~0U << BLOCK_IDX_TO_BIT_OFFSET(idx));
+        if (word)
+        {
+            idx = BITMAP_IDX_TO_BLOCK_IDX(word_idx) + bit_scan_forward(word);
+            break;
+        }
+        /* nothing left in this word - ask the summary about the next ones */
+        idx = word_idx + 1;
+    }
+
+    if (lvl == bm->lvl_cnt)
+        return -1;
+
+    /* and walk down to the block */
+    while (lvl-- > 0)
+        idx = BITMAP_IDX_TO_BLOCK_IDX(idx) + bit_scan_forward(bm->lvl[lvl][idx]);
+
+    return idx;
 }
 
-static int is_free_sequence(size_t block_idx, int block_cnt)
+/*
+ * Returns a mask of `cnt` bits starting from bit `offset`.
+ */
+static inline unsigned int bit_mask(size_t offset, size_t cnt)
 {
-    int i, idx, offset;
+    if (cnt >= BITMAP_BIT_CNT)
+        return ~0U << offset;
+    return ((1U << cnt) - 1) << offset;
+}
 
-    idx = BLOCK_IDX_TO_BITMAP_IDX(block_idx);
-    offset = BLOCK_IDX_TO_BIT_OFFSET(block_idx);
+/*
+ * Sets `cnt` bits of level `lvl` starting from `idx` a word at a time,
+ * then does the same for the summary of the touched words.
+ */
+static void bitmap_set_range(struct pmm_bitmap *bm, size_t lvl,
+                             size_t idx, size_t cnt)
+{
+    unsigned int *words;
+    size_t first, last;
 
-    for (i = 0; i < block_cnt; i++, offset++)
+    for (; cnt > 0 && lvl < bm->lvl_cnt; lvl++)
     {
-        if (offset > BITMAP_BIT_CNT)
+        words = bm->lvl[lvl];
+        first = BLOCK_IDX_TO_BITMAP_IDX(idx);
+        last = BLOCK_IDX_TO_BITMAP_IDX(idx + cnt - 1);
+
+        if (first == last)
+            words[first] |= bit_mask(BLOCK_IDX_TO_BIT_OFFSET(idx), cnt);
+        else
         {
-            offset = 0;
-            idx++;
+            words[first] |= ~0U << BLOCK_IDX_TO_BIT_OFFSET(idx);
+            memset(&words[first + 1], 0xFF, (last - first - 1) * INT_BYTE);
+            words[last] |= bit_mask(0, BLOCK_IDX_TO_BIT_OFFSET(idx + cnt - 1) + 1);
         }
 
-        if (IS_BIT_SET(mem_bitmap[idx], offset))
-            continue;
-        else
-            return 0;
+        /* all touched words are not empty now */
+        idx = first;
+        cnt = last - first + 1;
     }
-    return 1;
 }
 
-static unsigned int find_free_blocks(int count)
+/*
+ * Unsets `cnt` bits of level `lvl` starting from `idx` a word at a time,
+ * then does the same for the summary of the words which got empty.
+ */
+static void bitmap_unset_range(struct pmm_bitmap *bm, size_t lvl,
+                               size_t idx, size_t cnt)
 {
-    size_t i;
+    unsigned int *words;
+    size_t first, last;
 
-    if (!pmm.blocks_free)
-        return -ENOMEM;
+    for (; cnt > 0 && lvl < bm->lvl_cnt; lvl++)
+    {
+        words = bm->lvl[lvl];
+        first = BLOCK_IDX_TO_BITMAP_IDX(idx);
+        last = BLOCK_IDX_TO_BITMAP_IDX(idx + cnt - 1);
 
-    for (i = 0; i < pmm.block_cnt; i++)
-        if (!is_map_idx_full(i))
+        if (first == last)
+            words[first] &= ~bit_mask(BLOCK_IDX_TO_BIT_OFFSET(idx), cnt);
+        else
         {
-            int free_bit = get_free_bit(mem_bitmap[i]);
-            if (free_bit < 0)
-                return -ENOMEM;
-            int bit_idx = BITMAP_IDX_TO_BLOCK_IDX(i) + free_bit;
-            if (is_free_sequence(bit_idx, count))
-                return bit_idx;
+            words[first] &= ~(~0U << BLOCK_IDX_TO_BIT_OFFSET(idx));
+            memset(&words[first + 1], 0, (last - first - 1) * INT_BYTE);
+            words[last] &= ~bit_mask(0, BLOCK_IDX_TO_BIT_OFFSET(idx + cnt - 1) + 1);
         }
 
-    return -EFAULT;
+        /* the middle words are empty, the edge ones might be not */
+        if (words[first])
+            first++;
+        if (last >= first && words[last])
+            last--;
+        if (last + 1 <= first)
+            break;
+
+        idx = first;
+        cnt = last - first + 1;
+    }
+}
+
+/*
+ * Returns the index of the first unset bit of level 0 in [`idx`, `end`),
+ * or `end` if there is none.
+ */
+static size_t bitmap_find_unset_from(struct pmm_bitmap *bm, size_t idx, size_t end)
+{
+    unsigned int word;
+
+    while (idx < end)
+    {
+        word = ~bm->lvl[0][BLOCK_IDX_TO_BITMAP_IDX(idx)] &
+                (~0U << BLOCK_IDX_TO_BIT_OFFSET(idx));
+        if (word)
+        {
+            idx = idx - BLOCK_IDX_TO_BIT_OFFSET(idx) + bit_scan_forward(word);
+            break;
+        }
+        idx = idx - BLOCK_IDX_TO_BIT_OFFSET(idx) + BITMAP_BIT_CNT;
+    }
+
+    return MIN(idx, end);
+}
+
+/*
+ * Returns the byte count bitmap_init() takes for `bits`.
+ */
+static size_t bitmap_size(size_t bits)
+{
+    size_t words, lvl = 0, bytes = 0;
+
+    do {
+        words = BITS_TO_BITMAP_WORDS(bits);
+        bytes += words * INT_BYTE;
+        bits = words;
+        lvl++;
+    } while (words > 1 && lvl < BITMAP_LVL_MAX);
+
+    return bytes;
+}
+
+/*
+ * Returns the byte count of the bitmaps and the page frame
+ * database for `block_cnt` blocks.
+ */
+static size_t tables_size(size_t block_cnt)
+{
+    unsigned int order;
+    size_t bytes = bitmap_size(block_cnt);
+
+    for (order = 0; order < PMM_ORDER_CNT; order++)
+        bytes += bitmap_size((block_cnt >> order) + 1);
+
+    return bytes + block_cnt * sizeof(struct page);
+}
+
+/*
+ * Initializes PMM.
+ * The bitmaps and the frame database are laid out from `bitmap_loc`
+ * and must not reach `bitmap_end`, so memory the tables can't cover
+ * is left out.
+ * Returns the end of PMM bitmaps.
+ */
+addr_t pmm_init(unsigned int mem_kb, addr_t bitmap_loc, addr_t bitmap_end)
+{
+    unsigned int order;
+    size_t order_bits, idx;
+
+    pmm.block_cnt = SIZE_KB_TO_BLOCKS(mem_kb);
+    while (pmm.block_cnt &&
+           bitmap_loc + tables_size(pmm.block_cnt) > bitmap_end)
+        pmm.block_cnt -= MIN(pmm.block_cnt, 1U << PMM_MAX_ORDER);
+    if (!pmm.block_cnt)
+        kernel_panic("PMM: no room for the frame database");
+    pmm.blocks_free = 0;
+    pmm.krnl_size = 0;
+
+    /* zone boundaries are aligned to the max order,
+     * so buddy areas never cross them */
+    pmm.zones[ZONE_DMA].from = 0;
+    pmm.zones[ZONE_DMA].to = MIN(MEM_TO_BLOCK_IDX(ZONE_DMA_LIMIT), pmm.block_cnt);
+    pmm.zones[ZONE_NORMAL].from = pmm.zones[ZONE_DMA].to;
+    pmm.zones[ZONE_NORMAL].to = pmm.block_cnt;
+
+    /* on init set all memory as reservered */
+    bitmap_loc = bitmap_init(&mem_bitmap, pmm.block_cnt, bitmap_loc);
+    for (order = 0; order < PMM_ORDER_CNT; order++)
+    {
+        order_bits = (pmm.block_cnt >> order) + 1;
+        bitmap_loc = bitmap_init(&order_map[order], order_bits, bitmap_loc);
+    }
+
+    memset(area_cache, 0, sizeof(area_cache));
+    for (order = 0; order <= PMM_CACHE_MAX_ORDER; order++)
+    {
+        area_cache[order].low = cache_watermarks[order][0];
+        area_cache[order].high = cache_watermarks[order][1];
+    }
+
+    /* page frame database goes right after the bitmaps */
+    pages = (struct page *) bitmap_loc;
+    memset(pages, 0, pmm.block_cnt * sizeof(struct page));
+    for (idx = 0; idx < pmm.block_cnt; idx++)
+    {
+        pages[idx].zone = idx < pmm.zones[ZONE_DMA].to ? ZONE_DMA : ZONE_NORMAL;
+        pages[idx].flags = PAGE_RESERVED;
+    }
+    bitmap_loc += pmm.block_cnt * sizeof(struct page);
+
+    register_shrinker(&zero_pool_shrinker);
+
+    return bitmap_loc;
+}
+
+/*
+ * Resets the page frame database entries of `cnt` blocks
+ * starting from `idx`.
+ */
+static void pages_reset(size_t idx, size_t cnt, unsigned short count,
+                        unsigned char flags)
+{
+    size_t end = idx + cnt;
+
+    for (; idx < end; idx++)
+    {
+        pages[idx].count = count;
+        pages[idx].flags = flags;
+        pages[idx].owner = 0;
+    }
+}
+
+/*
+ * Marks `cnt` blocks starting from `idx` as used.
+ */
+static void mark_used(size_t idx, size_t cnt)
+{
+    bitmap_unset_range(&mem_bitmap, 0, idx, cnt);
+}
+
+/*
+ * Marks `cnt` blocks starting from `idx` as free.
+ */
+static void mark_free(size_t idx, size_t cnt)
+{
+    bitmap_set_range(&mem_bitmap, 0, idx, cnt);
+}
+
+/*
+ * Takes a free area of 2^`order` blocks in `zone` out of the buddy
+ * allocator, splitting a bigger area if there is none of the exact size.
+ * Returns the first block index or -ENOMEM.
+ */
+static int buddy_alloc_zone(unsigned int order, enum mem_zone zone)
+{
+    unsigned int cur;
+    int area;
+    range_t *range = &pmm.zones[zone];
+
+    for (cur = order; cur < PMM_ORDER_CNT; cur++)
+    {
+        area = bitmap_find_from(&order_map[cur], range->from >> cur);
+        if (area >= 0 && ((size_t) area << cur) < range->to)
+            break;
+    }
+    if (cur == PMM_ORDER_CNT)
+        return -ENOMEM;
+
+    bitmap_unset(&order_map[cur], area);
+    /* keep the lower half, give the upper half back one order down */
+    while (cur > order)
+    {
+        cur--;
+        area <<= 1;
+        bitmap_set(&order_map[cur], area + 1);
+    }
+
+    return area << order;
+}
+
+/*
+ * Takes a free area of 2^`order` blocks out of the buddy allocator.
+ * Normal zone goes first to keep DMA reachable memory for I/O.
+ */
+static int buddy_alloc(unsigned int order)
+{
+    int idx;
+
+    idx = buddy_alloc_zone(order, ZONE_NORMAL);
+    if (idx < 0)
+        idx = buddy_alloc_zone(order, ZONE_DMA);
+
+    return idx;
+}
+
+/*
+ * Gives a free area of 2^`order` blocks back to the buddy allocator,
+ * merging it with its buddies for as long as they are free.
+ */
+static void buddy_free(size_t idx, unsigned int order)
+{
+    size_t area = idx >> order;
+    size_t buddy;
+
+    for (; order < PMM_MAX_ORDER; order++, area >>= 1)
+    {
+        buddy = area ^ 1;
+        if (buddy >= order_map[order].bit_cnt ||
+            !bitmap_test(&order_map[order], buddy))
+            break;
+        bitmap_unset(&order_map[order], buddy);
+    }
+
+    bitmap_set(&order_map[order], area);
+}
+
+/*
+ * Returns the highest order an area starting at `idx` can be aligned to.
+ */
+static inline unsigned int idx_align_order(size_t idx)
+{
+    if (!idx)
+        return PMM_MAX_ORDER;
+    return MIN(bit_scan_forward(idx), PMM_MAX_ORDER);
+}
+
+/*
+ * Gives an arbitrary range of blocks back to the buddy allocator
+ * by splitting it into the biggest naturally aligned areas.
+ */
+static void buddy_free_range(size_t idx, size_t cnt)
+{
+    unsigned int order;
+
+    while (cnt > 0)
+    {
+        order = idx_align_order(idx);
+        while ((1U << order) > cnt)
+            order--;
+
+        buddy_free(idx, order);
+        idx += 1 << order;
+        cnt -= 1 << order;
+    }
+}
+
+/*
+ * Returns the order of the smallest area fitting `block_cnt` blocks.
+ */
+static inline unsigned int blocks_to_order(size_t block_cnt)
+{
+    unsigned int order = 0;
+
+    while ((1U << order) < block_cnt)
+        order++;
+
+    return order;
+}
+
+/*
+ * Returns the page frame database entry of the block `pa` is in.
+ * Returns 0 if `pa` is beyond physical memory.
+ */
+struct page *pa_to_page(addr_t pa)
+{
+    size_t idx = MEM_TO_BLOCK_IDX(pa);
+
+    if (idx >= pmm.block_cnt)
+        return NULL;
+
+    return &pages[idx];
+}
+
+/*
+ * Returns the physical address of the block `page` describes.
+ */
+addr_t page_to_pa(struct page *page)
+{
+    return (addr_t) BLOCK_TO_MEM(page - pages);
+}
+
+/*
+ * Takes an extra reference to an allocated frame.
+ * Returns the new reference count.
+ */
+int page_get(struct page *page)
+{
+    if (!page->count || page->count == USHRT_MAX)
+        return -EBADARG;
+
+    return ++page->count;
+}
+
+/*
+ * Drops a reference to an allocated frame.
+ * The frame is freed when the last reference goes.
+ * Returns the remaining reference count.
+ */
+int page_put(struct page *page)
+{
+    if (!page->count)
+        return -EBADARG;
+
+    if (--page->count == 0)
+        pmm_dealloc(page_to_pa(page), BLOCK_SIZE);
+
+    return page->count;
 }
 
 /*
@@ -174,49 +655,461 @@ void set_krnl_size(size_t sz)
     pmm.krnl_size = sz;
 }
 
+/*
+ * Fills the cache of `order` areas from the buddy allocator
+ * up to its low watermark.
+ */
+static void cache_refill(struct pmm_cache *cache, unsigned int order)
+{
+    int idx;
+
+    while (cache->cnt < cache->low && (idx = buddy_alloc(order)) >= 0)
+    {
+        mark_used(idx, 1 << order);
+        cache->area[cache->cnt++] = idx;
+    }
+    cache->stats.refills++;
+}
+
+/*
+ * Gives the coldest areas of the `order` cache back to the buddy
+ * allocator until the cache is down to its low watermark.
+ */
+static void cache_drain(struct pmm_cache *cache, unsigned int order)
+{
+    size_t i, cnt;
+
+    if (cache->cnt <= cache->low)
+        return;
+
+    /* the bottom of the stack is the least recently freed */
+    cnt = cache->cnt - cache->low;
+    for (i = 0; i < cnt; i++)
+    {
+        mark_free(cache->area[i], 1 << order);
+        buddy_free(cache->area[i], order);
+    }
+    for (i = cnt; i < cache->cnt; i++)
+        cache->area[i - cnt] = cache->area[i];
+
+    cache->cnt -= cnt;
+    cache->stats.drains++;
+}
+
+/*
+ * Allocates 2^`order` blocks from the area cache or the buddy allocator.
+ * Returns 0 on error.
+ */
+static void *alloc_order(unsigned int order)
+{
+    struct pmm_cache *cache;
+    int idx;
+
+    if (order > PMM_MAX_ORDER || pmm.blocks_free < (1U << order))
+        return NULL;
+
+    if (order <= PMM_CACHE_MAX_ORDER)
+    {
+        cache = &area_cache[order];
+        if (cache->cnt)
+            cache->stats.hits++;
+        else
+        {
+            cache->stats.misses++;
+            cache_refill(cache, order);
+        }
+
+        if (cache->cnt)
+        {
+            idx = cache->area[--cache->cnt];
+            pmm.blocks_free -= 1 << order;
+            pages_reset(idx, 1 << order, 1, 0);
+            return BLOCK_TO_MEM(idx);
+        }
+        /* cache is turned off - go straight to the buddy allocator */
+    }
+
+    idx = buddy_alloc(order);
+    if (idx < 0)
+        return NULL;
+
+    mark_used(idx, 1 << order);
+    pmm.blocks_free -= 1 << order;
+    pages_reset(idx, 1 << order, 1, 0);
+
+    return BLOCK_TO_MEM(idx);
+}
+
+/*
+ * Allocates 2^`order` physically contiguous blocks,
+ * aligned to their size. Memory is reclaimed once if
+ * there is not enough of it.
+ * Returns 0 on error.
+ */
+void *pmm_alloc_order(unsigned int order)
+{
+    void *mem;
+
+    if (order > PMM_MAX_ORDER)
+        return NULL;
+
+    mem = alloc_order(order);
+    if (!mem && reclaim_pages(1 << order))
+        mem = alloc_order(order);
+
+    return mem;
+}
+
+/*
+ * Allocates 2^`order` physically contiguous blocks from `zone` only.
+ * Returns 0 on error.
+ */
+void *pmm_alloc_zone(unsigned int order, enum mem_zone zone)
+{
+    int idx;
+
+    if (order > PMM_MAX_ORDER || zone >= ZONE_CNT ||
+        pmm.blocks_free < (1U << order))
+        return NULL;
+
+    idx = buddy_alloc_zone(order, zone);
+    if (idx < 0)
+        return NULL;
+
+    mark_used(idx, 1 << order);
+    pmm.blocks_free -= 1 << order;
+    pages_reset(idx, 1 << order, 1, 0);
+
+    return BLOCK_TO_MEM(idx);
+}
+
+/*
+ * Allocates a buffer for ISA DMA transfers of up to `bytes`.
+ * The buffer is below 16MB and, since areas are aligned to their size,
+ * never crosses a 64KB boundary.
+ * Free it with pmm_dealloc() and the same `bytes`.
+ * Returns 0 on error.
+ */
+void *pmm_alloc_dma(size_t bytes)
+{
+    unsigned int block_count, order;
+    void *mem;
+
+    if (!bytes || bytes > ZONE_DMA_BOUNDARY)
+        return NULL;
+
+    block_count = SIZE_B_TO_BLOCKS(bytes);
+    order = blocks_to_order(block_count);
+    mem = pmm_alloc_zone(order, ZONE_DMA);
+    if (!mem)
+        return NULL;
+
+    /* the tail of the area which isn't needed goes straight back */
+    if (block_count < (1U << order))
+        pmm_dealloc((addr_t) mem + block_count * BLOCK_SIZE,
+                    ((1 << order) - block_count) * BLOCK_SIZE);
+
+    return mem;
+}
+
+/*
+ * Frees 2^`order` blocks previously allocated by pmm_alloc_order().
+ */
+int pmm_free_order(void *addr, unsigned int order)
+{
+    struct pmm_cache *cache;
+    size_t idx = MEM_TO_BLOCK_IDX((addr_t) addr);
+
+    if (order > PMM_CACHE_MAX_ORDER || !area_cache[order].high)
+        return pmm_dealloc((addr_t) addr, BLOCK_SIZE << order);
+
+    if (idx >= pmm.block_cnt || bitmap_test(&mem_bitmap, idx))
+        return -EBADADDR;
+
+    cache = &area_cache[order];
+    cache->area[cache->cnt++] = idx;
+    pmm.blocks_free += 1 << order;
+    pages_reset(idx, 1 << order, 0, 0);
+    if (cache->cnt > cache->high)
+        cache_drain(cache, order);
+
+    return 0;
+}
+
+/*
+ * Sets low/high watermarks of `order` area cache.
+ * Setting both to 0 turns the cache off.
+ */
+int pmm_cache_tune(unsigned int order, size_t low, size_t high)
+{
+    struct pmm_cache *cache;
+
+    if (order > PMM_CACHE_MAX_ORDER || low > high || high >= PMM_CACHE_SIZE)
+        return -EBADARG;
+
+    cache = &area_cache[order];
+    cache->low = low;
+    cache->high = high;
+    if (cache->cnt > cache->high)
+        cache_drain(cache, order);
+
+    return 0;
+}
+
+/*
+ * Fills `stats` with `order` area cache counters.
+ */
+int pmm_cache_stats(unsigned int order, struct pmm_cache_stats *stats)
+{
+    struct pmm_cache *cache;
+
+    if (order > PMM_CACHE_MAX_ORDER || !stats)
+        return -EBADARG;
+
+    cache = &area_cache[order];
+    *stats = cache->stats;
+    stats->cnt = cache->cnt;
+    stats->low = cache->low;
+    stats->high = cache->high;
+
+    return 0;
+}
+
+/*
+ * Zeroes the frame at `pa`, through the direct map if it's there.
+ * Returns 0 on success.
+ */
+static int zero_frame(addr_t pa)
+{
+    void *va = phys_to_virt(pa);
+
+    if (va)
+    {
+        memset(va, 0, BLOCK_SIZE);
+        return 0;
+    }
+
+    va = vmm_map_phys(pa, BLOCK_SIZE);
+    if (!va)
+        return -ENOMEM;
+    memset(va, 0, BLOCK_SIZE);
+    vmm_unmap_phys(va, BLOCK_SIZE);
+
+    return 0;
+}
+
+/*
+ * Pops a frame off the zero pool.
+ * Returns 0 if the pool is empty.
+ */
+static addr_t zero_pool_pop()
+{
+    unsigned int flags = x86_irq_save();
+    addr_t frame = zero_pool.cnt ? zero_pool.frame[--zero_pool.cnt] : 0;
+
+    x86_irq_restore(flags);
+    return frame;
+}
+
+/*
+ * Allocates a single block.
+ * With PMM_ZERO it comes zeroed, straight from the zero pool unless
+ * the pool has run dry. Free it with pmm_free_order(frame, 0).
+ * Returns 0 on error.
+ */
+void *pmm_alloc_page(unsigned int flags)
+{
+    addr_t frame;
+
+    if (flags & PMM_ZERO)
+    {
+        frame = zero_pool_pop();
+        if (frame)
+            return (void *) frame;
+    }
+
+    frame = (addr_t) pmm_alloc_order(0);
+    if (!frame)
+        /* pooled frames are better used than nothing */
+        return (void *) zero_pool_pop();
+
+    if ((flags & PMM_ZERO) && zero_frame(frame))
+    {
+        pmm_free_order((void *) frame, 0);
+        return NULL;
+    }
+
+    return (void *) frame;
+}
+
+/*
+ * Zeroes a few frames into the zero pool.
+ * Meant for the idle loop: the work is done in short slices with
+ * interrupts enabled in between, so a pending interrupt waits for
+ * a single frame's memset at most.
+ * The pool never takes the last ZERO_POOL_RESERVE free blocks.
+ * Returns true if the pool is still worth refilling.
+ */
+bool pmm_zero_refill()
+{
+    unsigned int flags;
+    addr_t frame;
+    void *va;
+    size_t i;
+
+    for (i = 0; i < ZERO_POOL_BATCH; i++)
+    {
+        flags = x86_irq_save();
+        if (zero_pool.cnt == ZERO_POOL_SIZE ||
+            pmm.blocks_free <= ZERO_POOL_RESERVE ||
+            !(frame = (addr_t) alloc_order(0)))
+        {
+            x86_irq_restore(flags);
+            return false;
+        }
+        x86_irq_restore(flags);
+
+        va = phys_to_virt(frame);
+        if (va)
+            memset(va, 0, BLOCK_SIZE);
+
+        flags = x86_irq_save();
+        if (!va || zero_pool.cnt == ZERO_POOL_SIZE)
+            /* not worth mapping it or somebody else filled the pool */
+            pmm_free_order((void *) frame, 0);
+        else
+            zero_pool.frame[zero_pool.cnt++] = frame;
+        x86_irq_restore(flags);
+
+        if (!va)
+            return false;
+    }
+
+    return zero_pool.cnt < ZERO_POOL_SIZE;
+}
+
+/*
+ * Shrinker of the zero pool - gives up to `cnt` pooled frames back.
+ * Returns the count of frames released.
+ */
+static size_t zero_pool_shrink(size_t cnt)
+{
+    unsigned int flags;
+    addr_t frame;
+    size_t freed = 0;
+
+    for (; freed < cnt; freed++)
+    {
+        flags = x86_irq_save();
+        frame = zero_pool.cnt ? zero_pool.frame[--zero_pool.cnt] : 0;
+        if (frame)
+            pmm_free_order((void *) frame, 0);
+        x86_irq_restore(flags);
+        if (!frame)
+            break;
+    }
+
+    return freed;
+}
+
+/*
+ * Returns the count of frames in the zero pool.
+ */
+size_t pmm_zero_pool_cnt()
+{
+    return zero_pool.cnt;
+}
+
 /*
  * Allocated `size` of blocks starting from `start`
  * Returns 0 on error.
  */
 void *pmm_alloc(unsigned int bytes)
 {
-    unsigned int i, idx, block_count;
+    unsigned int block_count, order;
+    int idx;
 
     if (!bytes)
         return NULL;
 
     block_count = SIZE_B_TO_BLOCKS(bytes);
+    order = blocks_to_order(block_count);
 
-    if (!pmm.blocks_free || pmm.blocks_free < block_count)
+    if (order > PMM_MAX_ORDER)
+        return NULL;
+    if (pmm.blocks_free < block_count)
+        reclaim_pages(block_count - pmm.blocks_free);
+    if (pmm.blocks_free < block_count)
         return NULL;
 
-    error = 0;
-    idx = find_free_blocks(block_count);
-    if (error == ENOMEM)
-        kernel_panic("PMM: out of memory");
+    /* exact area sizes can be served by the cache */
+    if (block_count == (1U << order))
+        return pmm_alloc_order(order);
 
+    /* enough free blocks, but maybe not in one piece */
+    idx = buddy_alloc(order);
+    if (idx < 0 && reclaim_pages(1 << order))
+        idx = buddy_alloc(order);
+    if (idx < 0)
+        return NULL;
+
+    /* the tail of the area which isn't needed goes straight back */
+    buddy_free_range(idx + block_count, (1 << order) - block_count);
+
+    mark_used(idx, block_count);
     pmm.blocks_free -= block_count;
-    for (i = 0; i < block_count; i++)
-        set_bit(idx+i);
+    pages_reset(idx, block_count, 1, 0);
 
     return BLOCK_TO_MEM(idx);
 }
 
+/*
+ * Frees used blocks in `cnt` blocks starting from `idx`.
+ * Blocks which are already free are skipped, the rest are handed
+ * to the buddy allocator a run of used blocks at a time.
+ * Returns the count of blocks freed.
+ */
+static size_t free_range(size_t idx, size_t cnt)
+{
+    size_t run_end, end = idx + cnt;
+    size_t freed = 0;
+    int next_free;
+
+    while (idx < end)
+    {
+        /* skip to the next used block */
+        idx = bitmap_find_unset_from(&mem_bitmap, idx, end);
+        if (idx == end)
+            break;
+
+        /* the run goes until the next free block */
+        next_free = bitmap_find_from(&mem_bitmap, idx);
+        run_end = next_free < 0 ? end : MIN((size_t) next_free, end);
+
+        mark_free(idx, run_end - idx);
+        buddy_free_range(idx, run_end - idx);
+        pages_reset(idx, run_end - idx, 0, 0);
+        freed += run_end - idx;
+        idx = run_end;
+    }
+
+    return freed;
+}
+
 /*
  * Deallocates previously allocated `size` bytes memory area starting
  * as `addr`
  */
 int pmm_dealloc(unsigned int addr, size_t size)
 {
-    size_t i;
     size_t idx = MEM_TO_BLOCK_IDX(addr);
 
     size = SIZE_B_TO_BLOCKS(size);
-    for (i = 0; i < size && idx <= pmm.block_cnt; i++, idx++)
-    {
-        unset_bit(idx);
-        pmm.blocks_free++;
-    }
+    if (idx >= pmm.block_cnt)
+        return -EBADADDR;
+    size = MIN(size, pmm.block_cnt - idx);
+
+    pmm.blocks_free += free_range(idx, size);
     return 0;
 }
 
@@ -224,20 +1117,99 @@ int pmm_dealloc(unsigned int addr, size_t size)
  * Registers a chunk of memory as usable
  * NOTE: BLOCK_SIZE aligned
  * NOTE2: everything what exceeds physical memory address is silently ignored.
+ * Returns the count of blocks registered.
  */
 int pmm_init_region(unsigned int addr, size_t size)
 {
-    size_t i, block_cnt;
+    size_t block_cnt, freed;
     unsigned int block_idx;
-        
+
     block_idx = MEM_TO_BLOCK_IDX(addr);
     block_cnt = SIZE_B_TO_BLOCKS(size);
+    if (block_idx >= pmm.block_cnt)
+        return 0;
+    block_cnt = MIN(block_cnt, pmm.block_cnt - block_idx);
+
+    freed = free_range(block_idx, block_cnt);
+    pmm.blocks_free += freed;
+
+    return freed;
+}
+
+/*
+ * Takes free blocks in `cnt` blocks starting from `idx` out of
+ * the buddy allocator. Blocks which are already used are skipped.
+ * Returns the count of blocks taken.
+ */
+static size_t buddy_take_range(size_t idx, size_t cnt)
+{
+    unsigned int order;
+    size_t area, start, end, taken = 0;
+    size_t range_end = idx + cnt;
+    int next_free;
+
+    while (idx < range_end)
+    {
+        /* skip used blocks */
+        if (!bitmap_test(&mem_bitmap, idx))
+        {
+            next_free = bitmap_find_from(&mem_bitmap, idx);
+            if (next_free < 0)
+                break;
+            idx = next_free;
+            continue;
+        }
+
+        /* find the free area the block belongs to */
+        for (order = 0; order < PMM_ORDER_CNT; order++)
+        {
+            area = idx >> order;
+            if (area < order_map[order].bit_cnt &&
+                bitmap_test(&order_map[order], area))
+                break;
+        }
+        if (order == PMM_ORDER_CNT)
+        {
+            /* not a part of any free area - leave it alone */
+            idx++;
+            continue;
+        }
+
+        /* take it whole and give back what is outside the range */
+        bitmap_unset(&order_map[order], area);
+        start = area << order;
+        end = MIN(start + (1 << order), range_end);
+        buddy_free_range(start, idx - start);
+        buddy_free_range(end, start + (1 << order) - end);
+
+        mark_used(idx, end - idx);
+        taken += end - idx;
+        idx = end;
+    }
+
+    return taken;
+}
+
+/*
+ * Registers a chunk of memory as not usable.
+ * Used for holes in the memory map and memory in use since boot.
+ * NOTE: must not be called on memory which was handed out to anyone.
+ */
+int pmm_deinit_region(unsigned int addr, size_t size)
+{
+    size_t block_idx, block_cnt, taken;
+
+    block_idx = MEM_TO_BLOCK_IDX(addr);
+    block_cnt = SIZE_B_TO_BLOCKS(size + MEM_TO_BLOCK_OFFSET(addr));
+    if (block_idx >= pmm.block_cnt)
+        return 0;
+    block_cnt = MIN(block_cnt, pmm.block_cnt - block_idx);
+
+    taken = buddy_take_range(block_idx, block_cnt);
+    pmm.blocks_free -= taken;
+    pages_reset(block_idx, block_cnt, 0, PAGE_RESERVED);
 
-    for (i = 0;
-         (i < block_cnt) || (block_idx + i < pmm.block_cnt);
-         i++, addr += BLOCK_SIZE)
-        pmm_dealloc(addr, 1);
-    return i;
+    return taken;
 }
 
 
@@ -0,0 +1,118 @@
+/******************************************************************************
+ *      Page reclaim
+ *
+ *      Gives memory back when free frames run low. Caches registered
+ *      as shrinkers are asked first, since what they hold is cheap to
+ *      rebuild, and only then the VMM's clock scan evicts cold pages.
+ *      Reclaim runs from the idle loop once free memory is below the
+ *      low watermark, and directly from the PMM when an allocation
+ *      would fail otherwise.
+ ******************************************************************************/
+
+#include <libc.h>
+#include <error.h>
+#include <x86/cpu.h>
+#include "mm.h"
+
+#define RECLAIM_LOW 128         /* free blocks which start idle reclaim */
+#define RECLAIM_HIGH 256        /* free blocks which stop it */
+#define RECLAIM_BATCH 16        /* pages reclaimed per idle loop pass */
+#define RECLAIM_SCAN_RATIO 32   /* pages scanned per page wanted */
+
+static struct shrinker *shrinkers = NULL;
+static bool reclaiming = false;     /* idle reclaim is below RECLAIM_HIGH */
+static bool busy = false;           /* reclaim is in progress */
+static size_t stuck_at = UINT_MAX;  /* free blocks when idle reclaim found nothing */
+
+/*
+ * Adds `shrinker` to the ones asked for memory on reclaim.
+ * The structure has to stay around until it is unregistered.
+ */
+void register_shrinker(struct shrinker *shrinker)
+{
+    shrinker->next = shrinkers;
+    shrinkers = shrinker;
+}
+
+/*
+ * Removes a registered shrinker.
+ * Returns -EBADARG if it isn't registered.
+ */
+int unregister_shrinker(struct shrinker *shrinker)
+{
+    struct shrinker **link;
+
+    for (link = &shrinkers; *link; link = &(*link)->next)
+    {
+        if (*link == shrinker)
+        {
+            *link = shrinker->next;
+            shrinker->next = NULL;
+            return 0;
+        }
+    }
+
+    return -EBADARG;
+}
+
+/*
+ * Tries to release `pages` pages - from the shrinkers first,
+ * then by evicting pages nobody touched lately.
+ * Shrinkers and the VMM's scan work in small steps, each with
+ * interrupts disabled. Reclaim might free memory which then gets
+ * allocated, so it's never entered twice.
+ * Returns the count of pages released.
+ */
+size_t reclaim_pages(size_t pages)
+{
+    struct shrinker *shrinker;
+    unsigned int flags;
+    size_t freed = 0;
+
+    flags = x86_irq_save();
+    if (busy || !pages)
+    {
+        x86_irq_restore(flags);
+        return 0;
+    }
+    busy = true;
+
+    x86_irq_restore(flags);
+
+    for (shrinker = shrinkers; shrinker && freed < pages; shrinker = shrinker->next)
+        freed += shrinker->shrink(pages - freed);
+
+    if (freed < pages)
+        freed += vmm_reclaim(pages - freed, (pages - freed) * RECLAIM_SCAN_RATIO);
+
+    busy = false;
+
+    return freed;
+}
+
+/*
+ * Reclaims a batch of pages if free memory is low.
+ * Once started, it goes on until the high watermark is reached,
+ * so it doesn't flip on and off around a single value. If nothing
+ * could be reclaimed it waits for free memory to change first.
+ * Returns true if there is more to reclaim.
+ */
+bool reclaim_idle()
+{
+    size_t free_blocks = get_free_mem_b() / PAGE_SIZE;
+
+    if (free_blocks < RECLAIM_LOW && free_blocks != stuck_at)
+        reclaiming = true;
+    else if (free_blocks >= RECLAIM_HIGH)
+        reclaiming = false;
+    if (!reclaiming)
+        return false;
+
+    if (!reclaim_pages(RECLAIM_BATCH))
+    {
+        stuck_at = free_blocks;
+        reclaiming = false;
+    }
+
+    return reclaiming;
+}
@@ -11,6 +11,7 @@
 #include "shell.h"
 
 extern int info_main(int argc, const char *argv[]);
+extern int tlbbench_main(int argc, char **argv);
 
 #define PROMPT_SIZE 30
 
@@ -28,6 +29,7 @@ struct shell_t {
     char *prompt;
     char *cmd_buf;
     struct frame_t frame;
+    struct arena *arena;    /* per command allocations */
 };
 
 static struct shell_t shell;
@@ -147,6 +149,7 @@ static void print_help()
     puts("\tclear - clears the screen");
     puts("\tinfo - prints some info about the system");
 	puts("\tls [folder] - print folder content");
+    puts("\ttlbbench - measures TLB refills across address space switches");
 }
 
 static char *get_cmd_token(char *cmd, size_t offset)
@@ -195,6 +198,15 @@ static char *get_cmd_token(char *cmd, size_t offset)
 	return start;
 }
 
+/*
+ * Returns the arena of the command being executed.
+ * Whatever a command allocates from it is released once it's done.
+ */
+struct arena *shell_arena()
+{
+    return shell.arena;
+}
+
 /*
  * Executes a command.
  */
@@ -202,7 +214,11 @@ static int exec_cmd(char *cmd)
 {
 	int argc = 0;
 	int offset = 0;
-	char **argv = (char **) kalloc(sizeof(char **) * SHELL_MAX_ARGC);
+	int ret = 0;
+	char **argv = (char **) arena_alloc(shell.arena, sizeof(char *) * (SHELL_MAX_ARGC + 1));
+
+	if (!argv)
+		return -1;
 
 	while (argv[argc] = get_cmd_token(cmd, offset))
 	{
@@ -211,12 +227,13 @@ static int exec_cmd(char *cmd)
 		if (argc > SHELL_MAX_ARGC)
 		{
 			printf("Too many arguments in command: %s\n", cmd);
-			return -1;
+			ret = -1;
+			goto out;
 		}
 	}
 
 	if (argc == 0)
-		return 0;
+		goto out;
 
     if (strcmp(argv[0], "help") == 0)
         print_help();
@@ -226,13 +243,17 @@ static int exec_cmd(char *cmd)
         info_main(argc, argv);
 	else if (strcmp(argv[0], "ls") == 0)
 		ls_main(argc, argv);
+    else if (strcmp(argv[0], "tlbbench") == 0)
+        tlbbench_main(argc, argv);
     else if (strcmp(argv[0], "") != 0)
     {
         printf("  No such command: %s", cmd);
         puts("");
     }
 
-    return 0;
+out:
+    arena_reset(shell.arena);
+    return ret;
 }
 
 /*
@@ -284,12 +305,16 @@ int shell_init(char *prmpt)
 
     delay.sec = 1;
     delay.day = delay.hour = delay.min = delay.mm = 0;
-    if (register_callback(CALLBACK_REPEAT, &delay, update_time_cb))
+    if (!register_callback(CALLBACK_REPEAT, &delay, update_time_cb, NULL))
         return -1;
 
     if (set_prompt(prmpt))
         return -2;
 
+    shell.arena = arena_create(PAGE_SIZE);
+    if (!shell.arena)
+        return -3;
+
     clear_screen();
     header_redraw();
     footer_redraw();
@@ -14,7 +14,10 @@
 /* Limits */
 #define SHELL_MAX_ARGC		10
 
+struct arena;
+
 int shell_init(char *prmpt);
 void shell_kbrd_cb(char c);
+struct arena *shell_arena();
 
 #endif /* end of include guard: SHELL_IA938IEU */
@@ -0,0 +1,457 @@
+/******************************************************************************
+ *      Slab allocator
+ *
+ *      Caches of equally sized kernel objects. Every cache owns slabs -
+ *      runs of pages split into object sized slots. A slab starts with
+ *      its header and a stack of free slot indexes, the objects follow.
+ *      Slab pages are tagged in the page frame database, so an object
+ *      finds its slab with a single lookup.
+ ******************************************************************************/
+
+#include <libc.h>
+#include <error.h>
+#include <linklist.h>
+#include <x86/cpu.h>
+#include "mm.h"
+
+#define SLAB_MAX_PAGES 8        /* biggest slab is 32KB */
+#define SLAB_MAX_WASTE 8        /* at most 1/8 of a slab is left unused */
+
+#define obj_align(b)    \
+    (((b) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+struct slab {
+    struct llist_t ll;
+    struct kmem_cache *cache;
+    char *objs;             /* the first object */
+    size_t free_cnt;
+    unsigned short free[];  /* free object indexes */
+};
+
+struct kmem_cache {
+    struct llist_t ll;
+    const char *name;
+    size_t obj_size;
+    size_t obj_cnt;     /* objects per slab */
+    size_t obj_offset;  /* offset of the first object in a slab */
+    size_t pages;       /* pages per slab */
+    kmem_ctor_t *ctor;
+    /* slab lists, NULL if empty */
+    struct slab *partial;
+    struct slab *full;
+    struct slab *empty;
+    size_t slab_cnt;
+    size_t inuse;       /* allocated objects in all slabs */
+};
+
+/* the cache `struct kmem_cache` themselves come from */
+static struct kmem_cache cache_cache;
+/* all created caches */
+static struct kmem_cache *cache_list = NULL;
+
+static struct shrinker slab_shrinker = {
+    .name = "slab",
+    .shrink = kmem_shrink_all
+};
+
+/* general purpose power of two size classes */
+#define KMALLOC_CLASS_CNT 8     /* 16 bytes to 2KB */
+static struct kmem_cache *size_caches[KMALLOC_CLASS_CNT];
+static const char *size_cache_names[KMALLOC_CLASS_CNT] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+/*
+ * Adds `slab` to the list which starts at `*list`.
+ */
+static void slab_list_add(struct slab **list, struct slab *slab)
+{
+    if (*list)
+        llist_add_before(*list, slab, ll);
+    else
+    {
+        llist_init(slab, ll);
+        *list = slab;
+    }
+}
+
+/*
+ * Removes `slab` from the list which starts at `*list`.
+ */
+static void slab_list_del(struct slab **list, struct slab *slab)
+{
+    if (llist_next(slab, ll) == slab)
+        *list = NULL;
+    else if (*list == slab)
+        *list = llist_next(slab, ll);
+    llist_delete(slab, ll);
+}
+
+/*
+ * Returns the slab `obj` belongs to or NULL if it isn't slab memory.
+ */
+static struct slab *obj_to_slab(void *obj)
+{
+    struct page *page;
+    addr_t pa = vmm_va_to_pa(obj);
+
+    if (!pa)
+        return NULL;
+    page = pa_to_page(pa);
+    if (!page || !(page->flags & PAGE_SLAB))
+        return NULL;
+
+    return (struct slab *) page->owner;
+}
+
+/*
+ * Sets up `cache` geometry for `size` bytes objects.
+ * The slab is grown until the leftover is small enough.
+ * Returns 0 on success.
+ */
+static int cache_init(struct kmem_cache *cache, const char *name,
+                      size_t size, kmem_ctor_t *ctor)
+{
+    size_t pages, obj_cnt, offset, space;
+
+    size = obj_align(size);
+
+    for (pages = 1; ; pages <<= 1)
+    {
+        space = pages * PAGE_SIZE - sizeof(struct slab);
+        obj_cnt = space / (size + sizeof(unsigned short));
+        offset = obj_align(sizeof(struct slab) +
+                           obj_cnt * sizeof(unsigned short));
+        if (obj_cnt && offset + obj_cnt * size > pages * PAGE_SIZE)
+            obj_cnt--;
+        space = pages * PAGE_SIZE - offset;
+        if (pages == SLAB_MAX_PAGES ||
+            (obj_cnt && (space - obj_cnt * size) * SLAB_MAX_WASTE <= space))
+            break;
+    }
+    if (!obj_cnt)
+        return -ESIZE;
+
+    cache->name = name;
+    cache->obj_size = size;
+    cache->obj_cnt = obj_cnt;
+    cache->obj_offset = offset;
+    cache->pages = pages;
+    cache->ctor = ctor;
+    cache->partial = cache->full = cache->empty = NULL;
+    cache->slab_cnt = 0;
+    cache->inuse = 0;
+
+    if (cache_list)
+        llist_add_before(cache_list, cache, ll);
+    else
+    {
+        llist_init(cache, ll);
+        cache_list = cache;
+    }
+
+    return 0;
+}
+
+/*
+ * Allocates a new slab for `cache` and runs the constructor
+ * on each of its objects.
+ * Returns NULL on error.
+ */
+static struct slab *slab_create(struct kmem_cache *cache)
+{
+    struct slab *slab;
+    struct page *page;
+    size_t i;
+
+    slab = (struct slab *) vmm_alloc_pages(cache->pages);
+    if (!slab)
+        return NULL;
+
+    /* tag every page, objects may sit in any of them */
+    for (i = 0; i < cache->pages; i++)
+    {
+        page = pa_to_page(vmm_va_to_pa((char *) slab + i * PAGE_SIZE));
+        page->flags |= PAGE_SLAB;
+        page->owner = (unsigned int) slab;
+    }
+
+    slab->cache = cache;
+    slab->objs = (char *) slab + cache->obj_offset;
+    slab->free_cnt = cache->obj_cnt;
+    /* lowest indexes on top of the stack */
+    for (i = 0; i < cache->obj_cnt; i++)
+    {
+        slab->free[i] = cache->obj_cnt - 1 - i;
+        if (cache->ctor)
+            cache->ctor(slab->objs + i * cache->obj_size);
+    }
+
+    cache->slab_cnt++;
+
+    return slab;
+}
+
+/*
+ * Gives pages of an empty `slab` back.
+ */
+static void slab_destroy(struct kmem_cache *cache, struct slab *slab)
+{
+    struct page *page;
+    size_t i;
+
+    for (i = 0; i < cache->pages; i++)
+    {
+        page = pa_to_page(vmm_va_to_pa((char *) slab + i * PAGE_SIZE));
+        page->flags &= ~PAGE_SLAB;
+        page->owner = 0;
+    }
+
+    vmm_free_pages(slab, cache->pages);
+    cache->slab_cnt--;
+}
+
+/*
+ * Creates a cache of `size` bytes objects.
+ * `ctor`, if given, is called on every object when its slab is created,
+ * not on every allocation, so objects have to be returned to the cache
+ * in their constructed state.
+ * Returns NULL on error.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     kmem_ctor_t *ctor)
+{
+    struct kmem_cache *cache;
+    int ret;
+
+    if (!name || !size)
+    {
+        error = EBADARG;
+        return NULL;
+    }
+
+    if (!cache_cache.obj_cnt)
+    {
+        cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), NULL);
+        register_shrinker(&slab_shrinker);
+    }
+
+    cache = (struct kmem_cache *) kmem_cache_alloc(&cache_cache);
+    if (!cache)
+    {
+        error = ENOMEM;
+        return NULL;
+    }
+
+    ret = cache_init(cache, name, size, ctor);
+    if (ret)
+    {
+        error = -ret;
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+/*
+ * Destroys a cache which has no allocated objects.
+ */
+int kmem_cache_destroy(struct kmem_cache *cache)
+{
+    if (!cache || cache == &cache_cache)
+        return -EBADARG;
+    if (cache->inuse)
+        return -EFAULT;
+
+    kmem_cache_shrink(cache);
+
+    if (llist_next(cache, ll) == cache)
+        cache_list = NULL;
+    else if (cache_list == cache)
+        cache_list = llist_next(cache, ll);
+    llist_delete(cache, ll);
+
+    return kmem_cache_free(&cache_cache, cache);
+}
+
+/*
+ * Allocates an object from `cache`.
+ * Partially used slabs are filled up first, then the empty one,
+ * and only then a new slab is created.
+ * Returns NULL on error.
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    struct slab *slab;
+
+    if (!cache)
+        return NULL;
+
+    slab = cache->partial;
+    if (!slab)
+    {
+        slab = cache->empty;
+        if (slab)
+            slab_list_del(&cache->empty, slab);
+        else if (!(slab = slab_create(cache)))
+            return NULL;
+        slab_list_add(&cache->partial, slab);
+    }
+
+    slab->free_cnt--;
+    cache->inuse++;
+    if (!slab->free_cnt)
+    {
+        slab_list_del(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    return slab->objs + slab->free[slab->free_cnt] * cache->obj_size;
+}
+
+/*
+ * Returns `obj` to `cache`.
+ * A single empty slab is kept around to absorb alloc/free bursts,
+ * any further ones are released right away.
+ */
+int kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    struct slab *slab;
+    size_t offset;
+
+    if (!cache || !obj)
+        return -EBADARG;
+
+    slab = obj_to_slab(obj);
+    if (!slab || slab->cache != cache)
+        return -EBADADDR;
+    offset = (char *) obj - slab->objs;
+    if ((char *) obj < slab->objs || offset % cache->obj_size ||
+        offset >= cache->obj_cnt * cache->obj_size ||
+        slab->free_cnt == cache->obj_cnt)
+        return -EBADADDR;
+
+    if (!slab->free_cnt)
+    {
+        slab_list_del(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    slab->free[slab->free_cnt++] = offset / cache->obj_size;
+    cache->inuse--;
+
+    if (slab->free_cnt == cache->obj_cnt)
+    {
+        slab_list_del(&cache->partial, slab);
+        if (cache->empty)
+            slab_destroy(cache, slab);
+        else
+            slab_list_add(&cache->empty, slab);
+    }
+
+    return 0;
+}
+
+/*
+ * Releases all empty slabs of `cache`.
+ * Returns the count of pages released.
+ */
+size_t kmem_cache_shrink(struct kmem_cache *cache)
+{
+    struct slab *slab;
+    size_t pages = 0;
+
+    if (!cache)
+        return 0;
+
+    while ((slab = cache->empty))
+    {
+        slab_list_del(&cache->empty, slab);
+        slab_destroy(cache, slab);
+        pages += cache->pages;
+    }
+
+    return pages;
+}
+
+/*
+ * Releases empty slabs of every cache until `pages` pages are gone.
+ * Interrupts are off while a cache is shrunk, but on in between.
+ * Returns the count of pages released.
+ */
+size_t kmem_shrink_all(size_t pages)
+{
+    struct kmem_cache *cache;
+    unsigned int flags;
+    size_t idx, freed = 0;
+
+    flags = x86_irq_save();
+    if (!cache_list)
+    {
+        x86_irq_restore(flags);
+        return 0;
+    }
+
+    llist_foreach(cache_list, cache, idx, ll)
+    {
+        if (freed >= pages)
+            break;
+        freed += kmem_cache_shrink(cache);
+        x86_irq_restore(flags);
+        flags = x86_irq_save();
+    }
+    x86_irq_restore(flags);
+
+    return freed;
+}
+
+/*
+ * Allocates `bytes` from the smallest size class which fits it.
+ * Classes are created on their first use.
+ * Returns NULL on error or if `bytes` is bigger than KMALLOC_MAX_SIZE.
+ */
+void *kmem_alloc(size_t bytes)
+{
+    size_t cls;
+
+    if (!bytes || bytes > KMALLOC_MAX_SIZE)
+        return NULL;
+
+    for (cls = 0; (size_t) (KMALLOC_MIN_SIZE << cls) < bytes; cls++)
+        ;
+
+    if (!size_caches[cls])
+    {
+        size_caches[cls] = kmem_cache_create(size_cache_names[cls],
+                                             KMALLOC_MIN_SIZE << cls, NULL);
+        if (!size_caches[cls])
+            return NULL;
+    }
+
+    return kmem_cache_alloc(size_caches[cls]);
+}
+
+/*
+ * Returns the usable size of slab object `obj` or 0 if it isn't one.
+ */
+size_t kmem_size(void *obj)
+{
+    struct slab *slab = obj_to_slab(obj);
+
+    return slab ? slab->cache->obj_size : 0;
+}
+
+/*
+ * Frees a slab object without knowing its cache.
+ */
+int kmem_free(void *obj)
+{
+    struct slab *slab = obj_to_slab(obj);
+
+    if (!slab)
+        return -EBADADDR;
+
+    return kmem_cache_free(slab->cache, obj);
+}
@@ -23,6 +23,8 @@
     (HOUR_TO_MILIS((day) * 24))
 
 struct time_t hw_time;
+/* milliseconds since the PIT started, never adjusted */
+milis_t uptime = 0;
 
 /*
  * Retrieves correct time from CMOS.
@@ -56,6 +58,7 @@ inline void update_clock_pit(unsigned int pit_hz)
     step.sec = step.min = step.hour = step.day = 0;
 
     time_add_time(&hw_time, &step);
+    uptime += step.mm;
 }
 
 static void check_time_overflow(struct time_t *t)
@@ -143,6 +146,15 @@ milis_t get_cur_milis()
     return time_to_milis(&hw_time);
 }
 
+/*
+ * Returns milliseconds since boot. Unlike get_cur_milis()
+ * it doesn't jump when the clock is set.
+ */
+milis_t get_uptime_milis()
+{
+    return uptime;
+}
+
 void clock_init()
 {
     update_clock_hw(&hw_time);
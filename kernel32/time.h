@@ -37,6 +37,7 @@ struct time_t *get_cur_time(struct time_t *t);
 struct time_t *time_add_time(struct time_t *t1, struct time_t *t2);
 milis_t time_to_milis(struct time_t *t);
 milis_t get_cur_milis();
+milis_t get_uptime_milis();
 void clock_init();
 void msdelay(unsigned int delay);
 
@@ -0,0 +1,590 @@
+/******************************************************************************
+ *      Virtual address space allocator
+ *
+ *      Free VA ranges of an address space are kept in an AVL tree keyed
+ *      by the start address. Every node also knows the biggest range in
+ *      its subtree, so the lowest fitting range is found by a single walk
+ *      from the root, and the neighbours of a freed range are found
+ *      the same way for coalescing.
+ *      Areas which are reserved, but backed by memory only when touched
+ *      (VMAs), are kept in a second tree of the same kind.
+ ******************************************************************************/
+
+#include <libc.h>
+#include <error.h>
+#include "mm.h"
+
+#define VA_BOOT_NODES 4
+
+struct va_node {
+    addr_t start;
+    size_t pages;
+    size_t max_pages;   /* biggest range in this subtree */
+    int height;
+    struct va_node *left;
+    struct va_node *right;
+};
+
+/*
+ * Nodes come from a slab cache, but the slab allocator itself needs
+ * kernel VA, so the first few nodes come from a static reserve.
+ */
+static struct kmem_cache *node_cache = NULL;
+static struct va_node boot_nodes[VA_BOOT_NODES];
+static struct va_node *boot_free = NULL;
+static size_t boot_used = 0;
+
+static struct va_node *node_alloc()
+{
+    struct va_node *node;
+
+    if (node_cache)
+        return (struct va_node *) kmem_cache_alloc(node_cache);
+
+    if (boot_free)
+    {
+        node = boot_free;
+        boot_free = node->left;
+        return node;
+    }
+    if (boot_used < VA_BOOT_NODES)
+        return &boot_nodes[boot_used++];
+
+    return NULL;
+}
+
+static void node_free(struct va_node *node)
+{
+    if (node >= boot_nodes && node < boot_nodes + VA_BOOT_NODES)
+    {
+        node->left = boot_free;
+        boot_free = node;
+    }
+    else
+        kmem_cache_free(node_cache, node);
+}
+
+static inline int height(struct va_node *node)
+{
+    return node ? node->height : 0;
+}
+
+static inline size_t max_pages(struct va_node *node)
+{
+    return node ? node->max_pages : 0;
+}
+
+/*
+ * Recalculates the cached height and biggest range of `node`.
+ */
+static void update(struct va_node *node)
+{
+    node->height = 1 + MAX(height(node->left), height(node->right));
+    node->max_pages = MAX(node->pages,
+                          MAX(max_pages(node->left), max_pages(node->right)));
+}
+
+static struct va_node *rotate_right(struct va_node *node)
+{
+    struct va_node *top = node->left;
+
+    node->left = top->right;
+    top->right = node;
+    update(node);
+    update(top);
+
+    return top;
+}
+
+static struct va_node *rotate_left(struct va_node *node)
+{
+    struct va_node *top = node->right;
+
+    node->right = top->left;
+    top->left = node;
+    update(node);
+    update(top);
+
+    return top;
+}
+
+/*
+ * Restores the AVL property of `node` subtree.
+ * Returns the new subtree root.
+ */
+static struct va_node *balance(struct va_node *node)
+{
+    int diff;
+
+    update(node);
+    diff = height(node->left) - height(node->right);
+
+    if (diff > 1)
+    {
+        if (height(node->left->left) < height(node->left->right))
+            node->left = rotate_left(node->left);
+        return rotate_right(node);
+    }
+    if (diff < -1)
+    {
+        if (height(node->right->right) < height(node->right->left))
+            node->right = rotate_right(node->right);
+        return rotate_left(node);
+    }
+
+    return node;
+}
+
+static struct va_node *insert(struct va_node *root, struct va_node *node)
+{
+    if (!root)
+    {
+        node->left = node->right = NULL;
+        update(node);
+        return node;
+    }
+
+    if (node->start < root->start)
+        root->left = insert(root->left, node);
+    else
+        root->right = insert(root->right, node);
+
+    return balance(root);
+}
+
+static struct va_node *remove_min(struct va_node *root, struct va_node **min)
+{
+    if (!root->left)
+    {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = remove_min(root->left, min);
+    return balance(root);
+}
+
+/*
+ * Unlinks the node starting at `start`. The node itself is not freed.
+ */
+static struct va_node *unlink(struct va_node *root, addr_t start)
+{
+    struct va_node *min, *right;
+
+    if (!root)
+        return NULL;
+
+    if (start < root->start)
+        root->left = unlink(root->left, start);
+    else if (start > root->start)
+        root->right = unlink(root->right, start);
+    else
+    {
+        if (!root->right)
+            return root->left;
+        right = remove_min(root->right, &min);
+        min->left = root->left;
+        min->right = right;
+        return balance(min);
+    }
+
+    return balance(root);
+}
+
+/*
+ * Refreshes cached values on the path to the node starting at `start`
+ * after it was resized in place.
+ */
+static void fixup(struct va_node *root, addr_t start)
+{
+    if (!root)
+        return;
+
+    if (start < root->start)
+        fixup(root->left, start);
+    else if (start > root->start)
+        fixup(root->right, start);
+    update(root);
+}
+
+/*
+ * Returns the node with the biggest start not above `va`.
+ */
+static struct va_node *find_floor(struct va_node *root, addr_t va)
+{
+    struct va_node *found = NULL;
+
+    while (root)
+    {
+        if (root->start <= va)
+        {
+            found = root;
+            root = root->right;
+        }
+        else
+            root = root->left;
+    }
+
+    return found;
+}
+
+/*
+ * Returns the node with the smallest start above `va`.
+ */
+static struct va_node *find_ceil(struct va_node *root, addr_t va)
+{
+    struct va_node *found = NULL;
+
+    while (root)
+    {
+        if (root->start > va)
+        {
+            found = root;
+            root = root->left;
+        }
+        else
+            root = root->right;
+    }
+
+    return found;
+}
+
+/*
+ * Creates the node cache. Has to be called once the kernel's
+ * address space is set up.
+ */
+int va_init()
+{
+    node_cache = kmem_cache_create("va_node", sizeof(struct va_node), NULL);
+
+    return node_cache ? 0 : -ENOMEM;
+}
+
+/*
+ * Sets `vs` up with [`from`, `to`) as a single free range.
+ */
+int va_space_init(struct va_space *vs, addr_t from, addr_t to)
+{
+    struct va_node *node;
+
+    if (from >= to || from % PAGE_SIZE || to % PAGE_SIZE)
+        return -EBADARG;
+
+    node = node_alloc();
+    if (!node)
+        return -ENOMEM;
+    node->start = from;
+    node->pages = (to - from) / PAGE_SIZE;
+
+    vs->from = from;
+    vs->to = to;
+    vs->free_pages = node->pages;
+    vs->root = insert(NULL, node);
+    vs->areas = NULL;
+
+    return 0;
+}
+
+/*
+ * Returns a copy of `node` subtree. If a node can't be allocated,
+ * `err` is set and the copy is only good for free_tree().
+ */
+static struct va_node *copy_tree(struct va_node *node, int *err)
+{
+    struct va_node *copy;
+
+    if (!node)
+        return NULL;
+
+    copy = node_alloc();
+    if (!copy)
+    {
+        *err = -ENOMEM;
+        return NULL;
+    }
+    *copy = *node;
+    copy->left = copy_tree(node->left, err);
+    copy->right = copy_tree(node->right, err);
+
+    return copy;
+}
+
+/*
+ * Makes `dst` a copy of `src`, free ranges and areas alike.
+ * On error `dst` still has to be released with va_space_destroy().
+ */
+int va_space_clone(struct va_space *dst, struct va_space *src)
+{
+    int err = 0;
+
+    dst->from = src->from;
+    dst->to = src->to;
+    dst->free_pages = src->free_pages;
+    dst->root = copy_tree(src->root, &err);
+    dst->areas = copy_tree(src->areas, &err);
+
+    return err;
+}
+
+static void free_tree(struct va_node *node)
+{
+    if (!node)
+        return;
+
+    free_tree(node->left);
+    free_tree(node->right);
+    node_free(node);
+}
+
+/*
+ * Releases all free range and area records of `vs`.
+ */
+void va_space_destroy(struct va_space *vs)
+{
+    free_tree(vs->root);
+    free_tree(vs->areas);
+    vs->root = vs->areas = NULL;
+    vs->free_pages = 0;
+}
+
+/*
+ * Allocates `pages` of VA, taking the lowest range which fits them.
+ * Never needs a new node, so it's safe to use by the slab allocator.
+ * Returns 0 on error.
+ */
+addr_t va_alloc(struct va_space *vs, size_t pages)
+{
+    struct va_node *node = vs->root;
+    addr_t va;
+
+    if (!pages || max_pages(node) < pages)
+        return 0;
+
+    /* the leftmost subtree which can fit it */
+    for (;;)
+    {
+        if (max_pages(node->left) >= pages)
+            node = node->left;
+        else if (node->pages >= pages)
+            break;
+        else
+            node = node->right;
+    }
+
+    va = node->start;
+    vs->free_pages -= pages;
+    if (node->pages == pages)
+    {
+        vs->root = unlink(vs->root, va);
+        node_free(node);
+    }
+    else
+    {
+        /* the start moves up, but stays below the next range */
+        node->start += pages * PAGE_SIZE;
+        node->pages -= pages;
+        fixup(vs->root, node->start);
+    }
+
+    return va;
+}
+
+/*
+ * Gives `pages` starting at `va` back, merging them with the free
+ * ranges around.
+ */
+int va_free(struct va_space *vs, addr_t va, size_t pages)
+{
+    struct va_node *prev, *next, *node;
+    addr_t end = va + pages * PAGE_SIZE;
+
+    if (!pages || va % PAGE_SIZE || va < vs->from || end > vs->to)
+        return -EBADADDR;
+
+    prev = find_floor(vs->root, va);
+    next = find_ceil(vs->root, va);
+    if ((prev && prev->start + prev->pages * PAGE_SIZE > va) ||
+        (next && next->start < end))
+        return -EBADADDR;   /* already free */
+
+    vs->free_pages += pages;
+
+    if (prev && prev->start + prev->pages * PAGE_SIZE == va)
+    {
+        prev->pages += pages;
+        if (next && next->start == end)
+        {
+            prev->pages += next->pages;
+            vs->root = unlink(vs->root, next->start);
+            node_free(next);
+        }
+        fixup(vs->root, prev->start);
+    }
+    else if (next && next->start == end)
+    {
+        /* the start moves down, but stays above the previous range */
+        next->start = va;
+        next->pages += pages;
+        fixup(vs->root, next->start);
+    }
+    else
+    {
+        node = node_alloc();
+        if (!node)
+        {
+            vs->free_pages -= pages;
+            return -ENOMEM;
+        }
+        node->start = va;
+        node->pages = pages;
+        vs->root = insert(vs->root, node);
+    }
+
+    return 0;
+}
+
+/*
+ * Takes a specific range of `pages` starting at `va` out of
+ * the free ranges. The whole range has to be free.
+ */
+int va_reserve(struct va_space *vs, addr_t va, size_t pages)
+{
+    struct va_node *node, *tail;
+    addr_t end = va + pages * PAGE_SIZE;
+    addr_t node_end;
+
+    if (!pages || va % PAGE_SIZE)
+        return -EBADARG;
+
+    node = find_floor(vs->root, va);
+    if (!node)
+        return -EBADADDR;
+    node_end = node->start + node->pages * PAGE_SIZE;
+    if (end > node_end)
+        return -EBADADDR;
+
+    /* the part above the reserved range becomes a range of its own */
+    tail = NULL;
+    if (end < node_end)
+    {
+        tail = node_alloc();
+        if (!tail)
+            return -ENOMEM;
+        tail->start = end;
+        tail->pages = (node_end - end) / PAGE_SIZE;
+    }
+
+    vs->free_pages -= pages;
+    if (node->start == va)
+    {
+        vs->root = unlink(vs->root, va);
+        node_free(node);
+    }
+    else
+    {
+        node->pages = (va - node->start) / PAGE_SIZE;
+        fixup(vs->root, node->start);
+    }
+    if (tail)
+        vs->root = insert(vs->root, tail);
+
+    return 0;
+}
+
+/*
+ * Records `pages` starting at `va` as an area which gets
+ * its memory on the first touch.
+ */
+int vma_add(struct va_space *vs, addr_t va, size_t pages)
+{
+    struct va_node *node;
+
+    if (!pages || va % PAGE_SIZE)
+        return -EBADARG;
+
+    node = node_alloc();
+    if (!node)
+        return -ENOMEM;
+    node->start = va;
+    node->pages = pages;
+    vs->areas = insert(vs->areas, node);
+
+    return 0;
+}
+
+/*
+ * Drops the area record starting at `va`.
+ * Returns its page count or 0 if there is no such area.
+ */
+size_t vma_del(struct va_space *vs, addr_t va)
+{
+    struct va_node *node = find_floor(vs->areas, va);
+    size_t pages;
+
+    if (!node || node->start != va)
+        return 0;
+
+    pages = node->pages;
+    vs->areas = unlink(vs->areas, va);
+    node_free(node);
+
+    return pages;
+}
+
+/*
+ * Returns the page count of the area starting at `va`
+ * or 0 if there is no such area.
+ */
+size_t vma_size(struct va_space *vs, addr_t va)
+{
+    struct va_node *node = find_floor(vs->areas, va);
+
+    return node && node->start == va ? node->pages : 0;
+}
+
+/*
+ * Changes the length of the area starting at `va` to `pages`.
+ * The VA it grows into has to be reserved by the caller.
+ */
+int vma_resize(struct va_space *vs, addr_t va, size_t pages)
+{
+    struct va_node *node = find_floor(vs->areas, va);
+
+    if (!pages)
+        return -EBADARG;
+    if (!node || node->start != va)
+        return -EBADADDR;
+
+    node->pages = pages;
+    fixup(vs->areas, va);
+
+    return 0;
+}
+
+/*
+ * Returns true if `va` is inside a recorded area.
+ */
+int vma_contains(struct va_space *vs, addr_t va)
+{
+    struct va_node *node = find_floor(vs->areas, va);
+
+    return node && va < node->start + node->pages * PAGE_SIZE;
+}
+
+/*
+ * Finds the first area which ends above `va`.
+ * Returns its start and sets `pages` to its page count,
+ * or returns 0 if there is no such area.
+ */
+addr_t vma_find(struct va_space *vs, addr_t va, size_t *pages)
+{
+    struct va_node *node = find_floor(vs->areas, va);
+
+    if (!node || va >= node->start + node->pages * PAGE_SIZE)
+        node = find_ceil(vs->areas, va);
+    if (!node)
+        return 0;
+
+    *pages = node->pages;
+    return node->start;
+}
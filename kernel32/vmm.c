@@ -6,9 +6,14 @@
 
 #include <libc.h>
 #include <error.h>
+#include <x86/cpu.h>
 #include "mm.h"
 
 #define CR0_ENABLE_PAGING 0x80000000
+#define CR0_WRITE_PROTECT 0x10000   /* read-only pages hold in ring 0 too */
+#define CR4_PSE 0x10
+#define CR4_PGE 0x80
+#define INVLPG_MAX 32   /* above that many pages reloading CR3 is cheaper */
 
 #define BIOS_PD_PA 0x9C000
 #define BIOS_PD_VA (BIOS_PD_PA)
@@ -19,17 +24,31 @@
 
 #define KRNL_PA_BASE 0x100000
 #define KRNL_VA_BASE 0xC0000000
+/* the first 4MB hold kernel's image, tables and stack */
+#define KRNL_HEAP_VA_BASE ((KRNL_VA_BASE) + 0x400000)
+#define KRNL_HEAP_VA_END (DIRECT_MAP_VA_BASE)
+/* all RAM which fits is mapped linearly there */
+#define DIRECT_MAP_VA_BASE 0xD0000000
+#define DIRECT_MAP_VA_END (PT_MAP_VA)
+/* the PD maps itself in the last PDE */
+#define SELF_MAP_PDE_IDX ((PD_ENTRY_CNT) - 1)
+#define PT_MAP_VA 0xFFC00000    /* PTEs of the current address space */
+#define PD_MAP_VA 0xFFFFF000    /* PDEs of the current address space */
+#define USR_VA_BASE 0x4000000
+#define USR_VA_END (KRNL_VA_BASE)
 #define KRNL_AREA_BYTE_COUNT    ((UINT_MAX) - ((KRNL_VA_BASE) - 1))
 #define KRNL_AREA_BLOCK_COUNT   ((KRNL_AREA_BYTE_COUNT) / (PAGE_SIZE))
+#define KRNL_PT_CNT ((KRNL_AREA_BLOCK_COUNT) / (PT_ENTRY_CNT))
+#define KRNL_PT_IDX ((PD_ENTRY_CNT) - (KRNL_PT_CNT)) /* the first kernel PDE */
+/* kernel's image and heap have 4KB page tables */
+#define KRNL_HEAP_PT_CNT (((KRNL_HEAP_VA_END) - (KRNL_VA_BASE)) / (LARGE_PAGE_SIZE))
 
-#define PAGE_SIZE 4096
 #define BYTES_PER_PTE (sizeof(union entry_t))
 #define PT_ENTRY_CNT 1024
 #define PD_ENTRY_CNT 1024
 #define PT_SIZE ((PT_ENTRY_CNT) * (BYTES_PER_PTE))
 #define PD_SIZE ((TABLE_SIZE) * (DIR_ENTRIES))
-
-#define MEM_MARK_SIZE (sizeof(unsigned int))
+#define LARGE_PAGE_SIZE ((PT_ENTRY_CNT) * (PAGE_SIZE)) /* a page a PDE maps */
 
 enum pte_flag {
     ENTRY_PRESENT     = 0x1,      /* 000000000001 */
@@ -37,17 +56,26 @@ enum pte_flag {
     ENTRY_SUPERVISOR  = 0x4,      /* 000000000100 */
                          /* RESERVED BY INTEL: 000000011000 */
     /* Following flags are set by CPU */
-    ENTRY_PAGE_ACCESSED = 0x10,   /* 000000100000 */
-    ENTRY_PAGE_DIRTY  = 0x20, /* 000001000000 */
-                         /* RESERVED BY INTEL: 000110000000 */
+    ENTRY_PAGE_ACCESSED = 0x20,   /* 000000100000 */
+    ENTRY_PAGE_DIRTY  = 0x40, /* 000001000000 */
+    ENTRY_LARGE_PAGE  = 0x80,     /* PDE maps a 4MB page, needs CR4.PSE */
+    ENTRY_GLOBAL      = 0x100,    /* survives CR3 reloads, needs CR4.PGE */
     /* Flags free to use by OS */
-    ENTRY_FREE_FLAG_0  = 0x100,    /* 001000000000 */
-    ENTRY_FREE_FLAG_1  = 0x200,    /* 010000000000 */
-    ENTRY_FREE_FLAG_2  = 0x400,    /* 100000000000 */
+    ENTRY_FREE_FLAG_0  = 0x200,    /* 001000000000 */
+    ENTRY_FREE_FLAG_1  = 0x400,    /* 010000000000 */
+    ENTRY_FREE_FLAG_2  = 0x800,    /* 100000000000 */
+    ENTRY_COW          = ENTRY_FREE_FLAG_0, /* read-only until written to */
                                         /* Remaining 12-31 bits: */
     ENTRY_FRAME_ADDR  = 0xfffff000    /* 11111111111111111111000000000000 */
 };
 
+/* page fault error code */
+enum pf_err {
+    PF_PRESENT  = 0x1,  /* protection violation, not a missing page */
+    PF_WRITE    = 0x2,  /* caused by a write */
+    PF_USER     = 0x4   /* happened in user mode */
+};
+
 enum mem_area {
     MEM_USR, MEM_KRNL
 };
@@ -57,35 +85,33 @@ union entry_t {
     unsigned char flag;
 };
 
-struct pt_t {
-    //addr_t *entry; /* pointer to 1024 linear PTEs */
-    union entry_t *table;
-    union entry_t pt_pa;
-    size_t used_entries; /* number of allocated PTEs */
-    size_t full_entries; /* number of full entries */
-    /* FULL_PTE_LIMIT is used to tell if the entry is full */
-};
-#define FULL_PTE_LIMIT 3072  /* 3/4 of a PAGE_SIZE */
-
+/*
+ * An address space.
+ * Its PD maps itself through the last PDE, so while it is the current
+ * one every PTE shows up at PT_MAP_VA and every PDE at PD_MAP_VA.
+ * Only the user part has its own page tables, kernel's page tables
+ * are shared by all address spaces.
+ */
 struct pd_t {
-    addr_t *pd_va; /* pointer to PD with 1024 linear PAs */
     addr_t pd_pa; /* goes into CR3 */
-    struct pt_t pt[PT_ENTRY_CNT]; /* page tables */
+    struct va_space usr_va; /* free user space VA ranges */
     struct pd_t *next, *prev; /* pointers to next/prev PDs */
 };
 
 struct vmm_t {
     struct pd_t *cur_pd;
     size_t pd_count;   /* currently active PD count */
-    /* kernel PTs is linear 1MB chunk just above the kernel */
+    /* kernel PTs is linear chunk just above the kernel */
     addr_t krnl_pt_pa; /* physical addr of kernel PTs*/
     addr_t krnl_pt_va; /* VA of kernel PTs */
     size_t krnl_pt_offset; /* offset in PD which starts kernel's area */
     size_t krnl_pt_idx; /* index to PD which starts kernel's area */
-    /* kernel's PTs */
     struct pd_t bios_pd;
-    struct pt_t krnl_pts[KRNL_AREA_BLOCK_COUNT / PD_ENTRY_CNT];
     size_t mem_kb;
+    bool large_pages;   /* CPU supports 4MB pages */
+    bool global_pages;  /* CPU supports global pages */
+    bool global_on;     /* CR4.PGE is set */
+    size_t direct_map_bytes; /* RAM reachable through the direct map */
 };
 
 /* XXX: below macros works on 0xC0000000 - 0xC0400000 VA range only! */
@@ -117,29 +143,8 @@ struct vmm_t {
         (vmm)->krnl_pt_offset = 0;  \
         (vmm)->krnl_pt_idx = 0; \
         if ((arr_clean))    \
-        {   \
             memset((void *) &(vmm)->bios_pd, 0, \
                     sizeof(typeof((vmm)->bios_pd)));   \
-            memset((void *) &(vmm)->krnl_pts[0], 0, \
-                    ARRAY_LENGTH((vmm)->krnl_pts)); \
-        }   \
-    } while (0);
-
-#define empty_pd(pd, arr_clean)    \
-    do {    \
-        (pd)->pd_va = NULL; \
-        (pd)->pd_pa = 0;    \
-        (pd)->next = (pd)->prev = pd;   \
-        if ((arr_clean))  \
-            memset((void *) &(pd)->pt, 0, ARRAY_LENGTH((pd)->pt));  \
-    } while (0);
-
-#define empty_pt(pt)   \
-    do {    \
-        (pt)->table = NULL;   \
-        (pt)->pt_pa.addr = 0;      \
-        (pt)->full_entries = 0;   \
-        (pt)->used_entries = 0;   \
     } while (0);
 
 static struct vmm_t vmm = {
@@ -152,24 +157,100 @@ static struct vmm_t vmm = {
     .mem_kb = 0
 };
 
-static range_t lookup_range_usr = {
-    .from = 0x4000000,
-    .to = 0xC0000000
-};
-static range_t lookup_range_krnl = {
-    .from = 0xC0000000,
-    .to = UINT_MAX
-};
+/* free kernel VA ranges, shared by all address spaces */
+static struct va_space va_space_krnl;
 
-static void load_pd(struct pd_t *pd)
+/*
+ * Sets `flags` in CR4.
+ */
+static void cr4_set(unsigned int flags)
+{
+    __asm__ __volatile__("mov %%cr4, %%eax \n"
+                         "or %0, %%eax \n"
+                         "mov %%eax, %%cr4 \n"
+                    :
+                    : "c" (flags)
+                    : "eax");
+}
+
+/*
+ * Sets `flags` in CR0.
+ */
+static void cr0_set(unsigned int flags)
+{
+    __asm__ __volatile__("mov %%cr0, %%eax \n"
+                         "or %0, %%eax \n"
+                         "mov %%eax, %%cr0 \n"
+                    :
+                    : "c" (flags)
+                    : "eax");
+}
+
+/*
+ * Clears `flags` in CR4.
+ */
+static void cr4_clear(unsigned int flags)
+{
+    __asm__ __volatile__("mov %%cr4, %%eax \n"
+                         "not %0 \n"
+                         "and %0, %%eax \n"
+                         "mov %%eax, %%cr4 \n"
+                    : "+c" (flags)
+                    :
+                    : "eax");
+}
+
+/*
+ * Reloads CR3 with the current PD, which flushes the TLB.
+ * Global kernel mappings stay.
+ */
+static void flush_tlb()
 {
     __asm__ __volatile__("movl %0, %%eax \n"
                          "movl %%eax, %%cr3 \n"
                     :
-                    : "m" (pd->pd_pa)
+                    : "m" (vmm.cur_pd->pd_pa)
                     : "eax");
 }
 
+/*
+ * Switches to `pd` address space.
+ * CR3 is only written if it is not the current one already,
+ * as every write throws the whole TLB away.
+ */
+static void load_pd(struct pd_t *pd)
+{
+    if (pd == vmm.cur_pd)
+        return;
+
+    vmm.cur_pd = pd;
+    flush_tlb();
+}
+
+/*
+ * Flushes the whole TLB, global mappings included.
+ * Toggling CR4.PGE is the only thing which drops those.
+ */
+static void flush_tlb_global()
+{
+    if (!vmm.global_on)
+    {
+        flush_tlb();
+        return;
+    }
+
+    cr4_clear(CR4_PGE);
+    cr4_set(CR4_PGE);
+}
+
+/*
+ * Drops the TLB entry of a single page.
+ */
+static inline void invlpg(addr_t va)
+{
+    __asm__ __volatile__("invlpg (%0)" : : "r" (va) : "memory");
+}
+
 
 /*
  * Entry flag check routines.
@@ -200,24 +281,6 @@ static inline int is_page_dirty(union entry_t *entry)
     return entry->flag & ENTRY_PAGE_DIRTY;
 }
 
-/*
- * Check a sequence of `cnt` entries for a present flag.
- * Returns 1 if all passed,
- * or negative position of the first reached false condition.
- */
-static int sequence_is_present(union entry_t *entry, size_t cnt)
-{
-    size_t i;
-
-    for (i = 0; i < cnt; i++, entry += BYTES_PER_PTE)
-    {
-        if (is_present(entry))
-            return -i;
-    }
-
-    return 1;
-}
-
 /*
  * Entry flag manipulation routines.
  */
@@ -228,15 +291,15 @@ static inline union entry_t *entry_add_frame(union entry_t *entry, addr_t frame)
     return entry;
 }
 
-static inline union entry_t *entry_add_flag(union entry_t *entry, unsigned char flag)
+static inline union entry_t *entry_add_flag(union entry_t *entry, unsigned int flag)
 {
-    entry->flag |= flag;
+    entry->addr |= flag;
     return entry;
 }
 
-static inline union entry_t *entry_rm_flag(union entry_t *entry, unsigned char flag)
+static inline union entry_t *entry_rm_flag(union entry_t *entry, unsigned int flag)
 {
-    entry->flag &= (~flag);
+    entry->addr &= (~flag);
     return entry;
 }
 
@@ -265,41 +328,104 @@ static int sequence_unmake_present(union entry_t *entry, size_t cnt)
 }
 
 /*
- * Returns a pointer to the memory address where specified `va`
- * page info resides.
+ * Returns the PDE `va` falls under in the current address space.
  */
-static union entry_t *va_to_pt_entry(struct pd_t *pd, addr_t va)
+static inline union entry_t *va_to_pde(addr_t va)
 {
-    size_t pt_idx, pte_idx;
+    return (union entry_t *) PD_MAP_VA + va_to_pt_idx(va);
+}
 
-    pt_idx = va_to_pt_idx(va);
-    pte_idx = va_to_pte_idx(va);
+/*
+ * Returns the PTE of `va` in the current address space.
+ * The page table itself has to be present.
+ */
+static inline union entry_t *va_to_pte(addr_t va)
+{
+    return (union entry_t *) PT_MAP_VA + (va >> 12);
+}
 
-    /* return (addr_t *) &pd->pt[pt_idx].entry[pte_idx]; */
-    return &pd->pt[pt_idx].table[pte_idx];
+/*
+ * Returns the page table `va` belongs to, as seen through the self map.
+ */
+static inline union entry_t *va_to_pt(addr_t va)
+{
+    return va_to_pte(va & ~(LARGE_PAGE_SIZE - 1));
 }
 
 /*
- * Returns a pointer to a page table where given `va` is in.
+ * Returns ENTRY_GLOBAL if kernel mappings can be global, 0 otherwise.
+ * Kernel's half is the same in every address space, so its
+ * TLB entries don't need to go on every switch.
  */
-static struct pt_t *va_to_pd_pt(struct pd_t *pd, addr_t va)
+static inline unsigned int krnl_global_flag()
 {
-    size_t pt_idx;
+    return vmm.global_pages ? ENTRY_GLOBAL : 0;
+}
 
-    pt_idx = va_to_pt_idx(va);
+/*
+ * Returns the count of PDEs the direct map takes.
+ */
+static inline size_t direct_map_pde_cnt()
+{
+    return (vmm.direct_map_bytes + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
+}
+
+/*
+ * Maps RAM, as much of it as fits, linearly at DIRECT_MAP_VA_BASE.
+ * With PSE every PDE maps a 4MB page by itself, otherwise
+ * page tables are laid out starting at `pt_va`.
+ */
+static void direct_map_init(addr_t *pd, addr_t pt_va)
+{
+    size_t i;
+    size_t pde_cnt = direct_map_pde_cnt();
+    size_t pde_idx = va_to_pt_idx(DIRECT_MAP_VA_BASE);
+    addr_t pa;
+    union entry_t *table = (union entry_t *) pt_va;
+
+    if (vmm.large_pages)
+    {
+        cr4_set(CR4_PSE);
+        for (i = 0, pa = 0; i < pde_cnt; i++, pa += LARGE_PAGE_SIZE)
+            pd[pde_idx + i] =
+                pa | ENTRY_PRESENT | ENTRY_RW | ENTRY_LARGE_PAGE |
+                krnl_global_flag();
+        return;
+    }
+
+    for (i = 0, pa = 0; pa < vmm.direct_map_bytes; i++, pa += PAGE_SIZE)
+        table[i].addr = pa | ENTRY_PRESENT | ENTRY_RW | krnl_global_flag();
+    for (i = 0; i < pde_cnt; i++)
+        pd[pde_idx + i] =
+            krnl_va_to_pa(pt_va + i * PT_SIZE) | ENTRY_PRESENT | ENTRY_RW;
+}
 
-    return &pd->pt[pt_idx];
+/*
+ * Returns the byte count vmm_init() needs past `krnl_bin_end` at
+ * the very least - heap PTs and the page alignment of their start.
+ */
+size_t vmm_init_size()
+{
+    return KRNL_HEAP_PT_CNT * PT_SIZE + PAGE_SIZE;
 }
 
 /*
  * Initializes VMM.
+ * Kernel's image and heap get 4KB page tables, which are laid out
+ * linearly just above the kernel and must end before `tables_end`.
+ * The direct map uses 4MB pages if the CPU supports them, otherwise
+ * it is cut short to the PTs which fit.
+ * The image itself stays on 4KB pages, as it is loaded at
+ * KRNL_PA_BASE, which is not 4MB aligned.
+ * The PD is edited through the low 1MB identity map until
+ * its self map is in place.
  */
-int vmm_init(size_t mem_kb, addr_t krnl_bin_end)
+int vmm_init(size_t mem_kb, addr_t krnl_bin_end, addr_t tables_end)
 {
-    size_t i, cnt, step;
+    size_t i, pt_cnt;
     addr_t addr = page_align(krnl_bin_end);
     addr_t va;
-    struct pt_t *krnl_bin_pt;
+    addr_t *pd = (addr_t *) BIOS_PD_VA;
     union entry_t *entry;
 
     vmm.mem_kb = mem_kb;
@@ -308,132 +434,228 @@ int vmm_init(size_t mem_kb, addr_t krnl_bin_end)
     empty_vmm(&vmm, true);
     vmm.krnl_pt_va = addr;
     vmm.krnl_pt_pa = krnl_va_to_pa(addr);
-    vmm.krnl_pt_idx = PD_ENTRY_CNT - (KRNL_AREA_BLOCK_COUNT / PD_ENTRY_CNT);
+    vmm.krnl_pt_idx = KRNL_PT_IDX;
     vmm.krnl_pt_offset = vmm.krnl_pt_idx * BYTES_PER_PTE;
 
     /* Use BIOS created PD for the moment */
     vmm.bios_pd.pd_pa = BIOS_PD_PA;
-    vmm.bios_pd.pd_va = (addr_t *) BIOS_PD_VA;
+    vmm.bios_pd.next = vmm.bios_pd.prev = &vmm.bios_pd;
     vmm.cur_pd = &vmm.bios_pd;
-    vmm.pd_count = 0;
-
-    /* clear kernel PTs */                  /* 1 block = 1 PTE */
-    memset((void *) vmm.krnl_pt_va, 0, KRNL_AREA_BLOCK_COUNT * BYTES_PER_PTE);
-
-    /* prepare kernel PTs */
-    for (i = vmm.krnl_pt_idx,
-            va = vmm.krnl_pt_va, step = (PT_ENTRY_CNT * BYTES_PER_PTE);
-         i < PD_ENTRY_CNT; i++, va += step)
-    {
-        empty_pt(&vmm.cur_pd->pt[i]);
-        vmm.cur_pd->pt[i].table = (union entry_t *) va;
-        vmm.cur_pd->pt[i].pt_pa.addr = krnl_va_to_pa(va);
-        entry_add_flag(&vmm.cur_pd->pt[i].pt_pa, ENTRY_PRESENT);
-        entry_add_flag(&vmm.cur_pd->pt[i].pt_pa, ENTRY_RW);
-        vmm.cur_pd->pt[i].full_entries = 0;
-        vmm.cur_pd->pt[i].used_entries = 0;
-    }
+    vmm.pd_count = 1;
+    vmm.large_pages = (x86_cpu_features() & X86_FEATURE_PSE) != 0;
+    vmm.global_pages = (x86_cpu_features() & X86_FEATURE_PGE) != 0;
+    vmm.direct_map_bytes = MIN(get_total_mem_b(),
+                               DIRECT_MAP_VA_END - DIRECT_MAP_VA_BASE);
+
+    /* page tables have to end before `tables_end` */
+    if (addr + KRNL_HEAP_PT_CNT * PT_SIZE > tables_end)
+        return -ENOMEM;
+    if (!vmm.large_pages)
+        /* frames beyond a shorter direct map get mapped on demand */
+        vmm.direct_map_bytes = MIN(vmm.direct_map_bytes,
+            (tables_end - addr - KRNL_HEAP_PT_CNT * PT_SIZE) / PT_SIZE * LARGE_PAGE_SIZE);
+
+    /* clear kernel PTs, the direct map needs some too without PSE */
+    pt_cnt = KRNL_HEAP_PT_CNT + (vmm.large_pages ? 0 : direct_map_pde_cnt());
+    memset((void *) vmm.krnl_pt_va, 0, pt_cnt * PT_SIZE);
 
     /* Copy bootloader's prepared 768th table content to new loc */
-    entry = va_to_pt_entry(vmm.cur_pd, KRNL_VA_BASE);
-    cnt = PT_ENTRY_CNT * BYTES_PER_PTE;
-    memcpy((void *) entry, (void *) ((addr_t *) BIOS_KRNL_PT_VA), cnt);
-    /* set that table as present and full */
-    krnl_bin_pt = va_to_pd_pt(vmm.cur_pd, KRNL_VA_BASE);
-    krnl_bin_pt->full_entries = PT_ENTRY_CNT;
-    krnl_bin_pt->used_entries = PT_ENTRY_CNT;
-
-    /* after PTs are ready, map them to PD */
-    for (i = vmm.krnl_pt_idx; i < PD_ENTRY_CNT; i++)
-        vmm.cur_pd->pd_va[i] = vmm.cur_pd->pt[i].pt_pa.addr;
+    entry = (union entry_t *) vmm.krnl_pt_va;
+    memcpy((void *) entry, (void *) BIOS_KRNL_PT_VA, PT_SIZE);
+    for (i = 0; i < PT_ENTRY_CNT; i++)
+        if (is_present(&entry[i]))
+            entry_add_flag(&entry[i], krnl_global_flag());
+
+    /* map kernel PTs to PD */
+    for (i = 0, va = vmm.krnl_pt_va; i < KRNL_HEAP_PT_CNT; i++, va += PT_SIZE)
+        pd[KRNL_PT_IDX + i] = krnl_va_to_pa(va) | ENTRY_PRESENT | ENTRY_RW;
+    direct_map_init(pd, va);
+    pd[SELF_MAP_PDE_IDX] = BIOS_PD_PA | ENTRY_PRESENT | ENTRY_RW;
 
     /* load newly constructed PD */
-    load_pd(vmm.cur_pd);
+    flush_tlb();
+    vmm_set_global_pages(true);
+    /* kernel's writes to copy-on-write pages have to fault as well */
+    cr0_set(CR0_WRITE_PROTECT);
+
+    /* free VA ranges */
+    if (va_space_init(&va_space_krnl, KRNL_HEAP_VA_BASE, KRNL_HEAP_VA_END) ||
+        va_space_init(&vmm.bios_pd.usr_va, USR_VA_BASE, USR_VA_END) ||
+        va_init())
+        return -ENOMEM;
 
     return 0;
 }
 
 /*
- * Returns a VA of `b` size free space inside reusable PTE.
- * TODO: not finished!
+ * Returns a VA through which the frame at `pa` can be edited.
+ * That is its direct map address, only frames beyond the direct map
+ * get a mapping of their own.
+ * Returns NULL on error.
  */
-static addr_t find_block_reuse(struct pd_t *pd, size_t b, range_t *lookup_range)
+static void *map_frame(addr_t pa)
 {
-    addr_t va;
+    void *va = phys_to_virt(pa);
 
-    if (b < FULL_PTE_LIMIT)
-        return 0;
+    return va ? va : vmm_map_phys(pa, PAGE_SIZE);
+}
 
-    for (va = lookup_range->from; va < lookup_range->to; va += PAGE_SIZE)
-    {
-        struct pt_t *pt = va_to_pd_pt(pd, va);
+/*
+ * Releases a VA returned by map_frame().
+ */
+static void unmap_frame(void *va)
+{
+    if (!virt_to_phys(va))
+        vmm_unmap_phys(va, PAGE_SIZE);
+}
 
-        if (!is_present(&pt->pt_pa))
-            continue;
-        if (pt->full_entries == PT_ENTRY_CNT || pt->used_entries == 0)
-            continue;
+/*
+ * Allocates and hooks up the page table `va` belongs to
+ * in the current address space.
+ * Kernel's page tables are all there since vmm_init(),
+ * so it's only ever needed for user space.
+ * Returns 0 on success.
+ */
+static int alloc_pt(addr_t va)
+{
+    union entry_t *table = va_to_pt(va);
+    void *frame;
 
-        /* TODO: got the table with reusable entries. Do something... */
-    }
+    frame = pmm_alloc_page(PMM_ZERO);
+    if (!frame)
+        return -ENOMEM;
+
+    va_to_pde(va)->addr = (addr_t) frame | ENTRY_PRESENT | ENTRY_RW;
+    /* the self map might still have the old table cached */
+    invlpg((addr_t) table);
 
     return 0;
 }
 
 /*
- * Finds a sequence of available VA addresses to fit `cnt` pages.
+ * Unhooks the empty user space page table `va` belongs to
+ * and gives its frame back.
  */
-static addr_t find_blocks(struct pd_t *pd, size_t cnt, range_t *lookup_range)
+static void free_pt(addr_t va)
 {
-    addr_t va;
-    size_t i, j;
-    size_t found;
-    addr_t found_start;
+    union entry_t *pde = va_to_pde(va);
+    addr_t frame = pde->addr & ENTRY_FRAME_ADDR;
 
-    if (cnt == 0 || cnt > (lookup_range->to - lookup_range->from) / PAGE_SIZE)
-        return 0;
+    pde->addr = 0;
+    invlpg((addr_t) va_to_pt(va));
+    pmm_free_order((void *) frame, 0);
+}
 
-    for (va = lookup_range->from, found = 0, found_start = 0;
-          (va + (cnt * PAGE_SIZE)) < lookup_range->to;
-           va += PT_ENTRY_CNT * PAGE_SIZE)
-    {
-        struct pt_t *pt = va_to_pd_pt(pd, va);
+/*
+ * Returns true if no page is mapped through `table`.
+ */
+static bool pt_is_empty(union entry_t *table)
+{
+    size_t i;
 
-        /* check first if the table itself is present */
-        if (!is_present(&pt->pt_pa))
-            continue;
-        /* and that it is not full */
-        if (pt->full_entries == PT_ENTRY_CNT || pt->used_entries == PT_ENTRY_CNT)
+    for (i = 0; i < PT_ENTRY_CNT; i++)
+        if (is_present(&table[i]))
+            return false;
+
+    return true;
+}
+
+/*
+ * Maps a single page at `va` to physical frame `pa`
+ * in the current address space.
+ * Returns 0 on success.
+ */
+static int map_page(addr_t va, addr_t pa)
+{
+    union entry_t *entry;
+
+    if (!is_present(va_to_pde(va)) && alloc_pt(va))
+        return -ENOMEM;
+
+    entry = va_to_pte(va);
+    entry_add_frame(entry, pa);
+    entry_add_flag(entry, ENTRY_PRESENT);
+    entry_add_flag(entry, ENTRY_RW);
+    if (va >= KRNL_VA_BASE)
+        entry_add_flag(entry, krnl_global_flag());
+
+    return 0;
+}
+
+/*
+ * Gives a run of `cnt` physically contiguous frames back to the PMM.
+ */
+static void release_frames(addr_t pa, size_t cnt)
+{
+    if (cnt)
+        pmm_dealloc(pa, cnt * PAGE_SIZE);
+}
+
+/*
+ * Unmaps `cnt` pages starting at `va` in the current address space.
+ * If `release` is set, the frames go back to the PMM - shared ones
+ * just lose a reference. Physically contiguous frames are freed
+ * as one run, runs are flushed at every page table boundary,
+ * where the page table itself is released if it became empty.
+ * Missing page tables are skipped as a whole.
+ */
+static void unmap_range(addr_t va, size_t cnt, bool release)
+{
+    bool krnl = va >= KRNL_VA_BASE;
+    size_t i, skip;
+    addr_t pa, run_pa = 0;
+    size_t run_cnt = 0;
+    union entry_t *entry;
+    struct page *page;
+
+    for (i = 0; i < cnt; i++, va += PAGE_SIZE)
+    {
+        if (!is_present(va_to_pde(va)))
+        {
+            skip = PT_ENTRY_CNT - 1 - va_to_pte_idx(va);
+            i += skip;
+            va += skip * PAGE_SIZE;
             continue;
+        }
 
-        for (i = 0; i < PT_ENTRY_CNT; i++)
+        entry = va_to_pte(va);
+        if (is_present(entry))
         {
-            if (is_present(&pt->table[i]))
-                continue;
-            
-            for (j = i; j < PT_ENTRY_CNT; j++)
+            pa = entry->addr & ENTRY_FRAME_ADDR;
+            entry->addr = 0;
+            if (cnt <= INVLPG_MAX)
+                invlpg(va);
+
+            page = pa_to_page(pa);
+            if (!release || !page)
+                ;
+            else if (page->count > 1)
+                page_put(page);
+            else if (run_cnt && pa == run_pa + run_cnt * PAGE_SIZE)
+                run_cnt++;
+            else
             {
-                int look_cnt = MIN(PT_ENTRY_CNT - j, cnt);
-                int seq = sequence_is_present(&pt->table[j], look_cnt);
-                if (seq == 1)
-                {
-                    if (found == 0)
-                        found_start = va + (j * PAGE_SIZE);
-                    found += look_cnt;
-                }
-                else
-                {
-                    found = 0;
-                    found_start = 0;
-                    j += ABS(seq);
-                }
-
-                if (found >= cnt)
-                    return found_start;
+                release_frames(run_pa, run_cnt);
+                run_pa = pa;
+                run_cnt = 1;
             }
         }
+
+        /* the last page in this page table */
+        if (i + 1 == cnt || va_to_pte_idx(va) == PT_ENTRY_CNT - 1)
+        {
+            release_frames(run_pa, run_cnt);
+            run_cnt = 0;
+            if (va_to_pt_idx(va) < KRNL_PT_IDX && pt_is_empty(va_to_pt(va)))
+                free_pt(va);
+        }
     }
 
-    return 0;
+    /* kernel's mappings are global, CR3 reload wouldn't drop them */
+    if (cnt > INVLPG_MAX && krnl)
+        flush_tlb_global();
+    else if (cnt > INVLPG_MAX)
+        flush_tlb();
 }
 
 /*
@@ -443,137 +665,333 @@ static addr_t find_blocks(struct pd_t *pd, size_t cnt, range_t *lookup_range)
  */
 static int do_alloc_pages(addr_t va, size_t pg_count)
 {
-    size_t i;
+    size_t i, j;
+    unsigned int order;
     void *mem;
-    union entry_t *entry;
-    struct pt_t *pt;
 
-    for (i = 0; i < pg_count; i++)
+    for (i = 0; i < pg_count; i += 1 << order)
     {
-        /* get a physical memory */
-        mem = pmm_alloc(PAGE_SIZE);
+        /* get a physical memory in as big contiguous chunks as possible */
+        for (order = PMM_MAX_ORDER; (1U << order) > pg_count - i; order--)
+            ;
+        while (!(mem = pmm_alloc_order(order)) && order > 0)
+            order--;
         if (!mem)
-            return -ENOMEM;
+            goto fail;
 
         /* map physical memory to va */
-        entry = va_to_pt_entry(vmm.cur_pd, va + (i * PAGE_SIZE));
-        entry_add_frame(entry, (addr_t) mem);
-        entry_add_flag(entry, ENTRY_PRESENT);
-        entry_add_flag(entry, ENTRY_RW);
-
-        /* update the PT */
-        pt = va_to_pd_pt(vmm.cur_pd, va);
-        pt->used_entries++;
-        if (pt->used_entries == FULL_PTE_LIMIT)
-            pt->full_entries++;
+        for (j = 0; j < (1U << order); j++)
+        {
+            if (map_page(va + ((i + j) * PAGE_SIZE),
+                         (addr_t) mem + (j * PAGE_SIZE)))
+            {
+                release_frames((addr_t) mem + (j * PAGE_SIZE), (1 << order) - j);
+                i += j;
+                goto fail;
+            }
+        }
     }
 
     return 0;
+
+fail:
+    unmap_range(va, i, true);
+    return -ENOMEM;
 }
 
 /*
  * Returns a VA to a free memory chunk of `b` size.
  * Returns 0 on error.
  */
-static void *alloc_bytes(struct pd_t *pd, size_t b, enum mem_area area)
+static void *alloc_bytes(size_t b, enum mem_area area)
 {
     size_t block_cnt = bytes_to_blocks(b);   
     size_t last_blc_sz = b % PAGE_SIZE;
-    range_t *lookup_range =
-        (area == MEM_USR ? &lookup_range_usr : &lookup_range_krnl);
+    struct va_space *vs = (area == MEM_USR ? &vmm.cur_pd->usr_va : &va_space_krnl);
     addr_t va;
 
     if (!block_cnt && !last_blc_sz)
         return 0;
 
-/*
- *  Re-usable blocks are not implemented yet
- */
-    /* if (block_cnt == 1 && last_blc_sz < FULL_PTE_LIMIT) */
-    /* { */
-    /*     va = find_block_reuse(pd, b, lookup_range); */
-    /*     if (!va) */
-    /*         va = find_blocks(pd, 1, lookup_range); */
-    /*     if (!va) */
-    /*         return 0; */
-    /* } */
-    /* else */
-    {
-        va = find_blocks(pd, block_cnt, lookup_range);
-        if (!va)
-            return 0;
-    }
+    va = va_alloc(vs, block_cnt);
+    if (!va)
+        return 0;
 
     if (do_alloc_pages(va, block_cnt))
+    {
+        va_free(vs, va, block_cnt);
         return 0;
+    }
 
     return (void *) va;
 }
 
 /*
- * Every freshly allocated memory chunk will have the first DW
- * reserved for keeping track the allocation size in bytes,
- * which will be used when calling free().
+ * Returns the address space part `va` belongs to.
  */
-inline static void *mark_size(void *mem, size_t bytes)
+static struct va_space *va_to_space(addr_t va)
 {
-    *((int *) mem) = bytes;
-    
-    return mem + MEM_MARK_SIZE;
+    return va >= KRNL_VA_BASE ? &va_space_krnl : &vmm.cur_pd->usr_va;
 }
 
-inline static void *unmark_size(void *mem)
+/*
+ * Does the actual memory deallocation, so that [km]alloc could use it.
+ */
+static int dealloc_bytes(void *ptr, size_t b)
 {
-    return mem - MEM_MARK_SIZE;
+    size_t block_cnt = bytes_to_blocks(b);
+    addr_t va = (addr_t) ptr;
+
+    if (!block_cnt || !ptr)
+        return -EBADADDR;
+
+    unmap_range(va, block_cnt, true);
+
+    return va_free(va_to_space(va), va, block_cnt);
 }
 
-inline static size_t get_mark_size(void *mem)
+/*
+ * Returns the page frame database entry of the frame `va` is mapped to.
+ */
+static struct page *va_to_page(void *va)
 {
-    return *((int *) (mem - MEM_MARK_SIZE));
+    addr_t pa = vmm_va_to_pa(va);
+
+    return pa ? pa_to_page(pa) : NULL;
 }
 
 /*
- * Does the actual memory deallocation, so that [km]alloc could use it.
+ * Reserves whole pages for a request which is too big for the slab
+ * size classes. Nothing is mapped yet, every page gets its frame
+ * from the page fault handler on the first touch.
  */
-static int dealloc_bytes(void *ptr, size_t b)
+static void *alloc_large(size_t bytes, enum mem_area area)
+{
+    struct va_space *vs = (area == MEM_USR ? &vmm.cur_pd->usr_va : &va_space_krnl);
+    size_t pg_count = bytes_to_blocks(bytes);
+    addr_t va;
+
+    va = va_alloc(vs, pg_count);
+    if (!va)
+        return 0;
+
+    if (vma_add(vs, va, pg_count))
+    {
+        va_free(vs, va, pg_count);
+        return 0;
+    }
+
+    return (void *) va;
+}
+
+/*
+ * Resolves a write to a copy-on-write page at `va`.
+ * The page gets a private copy of the frame, unless nobody else
+ * shares the frame anymore, in which case it's just made writable.
+ * Returns 0 if the fault was resolved.
+ */
+static int cow_fault(addr_t va)
 {
-    size_t i;
-    size_t block_cnt = bytes_to_blocks(b);
-    addr_t addr = (addr_t) ptr;
-    struct pt_t *pt;
     union entry_t *entry;
-    
-    if (!block_cnt || !ptr)
+    struct page *page;
+    void *frame, *copy;
+
+    va -= va % PAGE_SIZE;
+    if (!is_present(va_to_pde(va)))
+        return -EFAULT;
+    entry = va_to_pte(va);
+    if (!(entry->addr & ENTRY_COW))
+        return -EFAULT;
+
+    page = pa_to_page(entry->addr & ENTRY_FRAME_ADDR);
+    if (page && page->count > 1)
+    {
+        frame = pmm_alloc_order(0);
+        if (!frame)
+            return -ENOMEM;
+        copy = map_frame((addr_t) frame);
+        if (!copy)
+        {
+            pmm_free_order(frame, 0);
+            return -ENOMEM;
+        }
+        memcpy(copy, (void *) va, PAGE_SIZE);
+        unmap_frame(copy);
+
+        entry_add_frame(entry, (addr_t) frame);
+        entry_add_flag(entry, ENTRY_PRESENT);
+        page_put(page);
+    }
+
+    entry_rm_flag(entry, ENTRY_COW);
+    entry_add_flag(entry, ENTRY_RW);
+    invlpg(va);
+
+    return 0;
+}
+
+/*
+ * Backs a page of a reserved area with a zeroed frame, or gives
+ * a copy-on-write page its own frame.
+ * Called on a page fault at `va` with CPU's error code `err`.
+ * Returns 0 if the fault was resolved.
+ */
+int vmm_page_fault(addr_t va, unsigned int err)
+{
+    void *frame;
+
+    /* the only protection violation fixed here is a write to COW page */
+    if (err & PF_PRESENT)
+        return (err & PF_WRITE) ? cow_fault(va) : -EFAULT;
+    if (!vma_contains(va_to_space(va), va))
         return -EBADADDR;
 
-    for (i = 0; i < block_cnt; i++, addr += PAGE_SIZE)
+    /* zeroed before it is visible at `va` */
+    frame = pmm_alloc_page(PMM_ZERO);
+    if (!frame)
+        return -ENOMEM;
+
+    va -= va % PAGE_SIZE;
+    if (map_page(va, (addr_t) frame))
     {
-        entry = va_to_pt_entry(vmm.cur_pd, addr);   
-        entry_rm_flag(entry, ENTRY_PRESENT);
-        
-        pt = va_to_pd_pt(vmm.cur_pd, addr);
-        pt->used_entries--;
-        if (pt->full_entries == FULL_PTE_LIMIT - 1)
-            pt->full_entries--;
-        /* if (!pt->used_entries) */
-        /*     entry_rm_flag(&pt->pt_pa, ENTRY_PRESENT); */
+        pmm_free_order(frame, 0);
+        return -ENOMEM;
     }
 
     return 0;
 }
 
+/* where the reclaim scan stopped the last time */
+static addr_t reclaim_hand = USR_VA_BASE;
+
+/*
+ * Gives the page at `va` a second chance if it was accessed since
+ * the last scan, otherwise evicts it if it's clean.
+ * A clean page of an area still holds the zeroes it was backed with,
+ * so it's just unmapped - the next touch faults in a fresh zeroed
+ * frame. Dirty pages have nowhere to go and stay, and so do shared
+ * and pinned ones.
+ * Has to be called with interrupts disabled, so nothing dirties
+ * the page or changes its page table halfway through.
+ * Returns true if the frame was released.
+ */
+static bool evict_page(addr_t va)
+{
+    union entry_t *entry;
+    struct page *page;
+
+    if (!is_present(va_to_pde(va)))
+        return false;
+    entry = va_to_pte(va);
+    if (!is_present(entry) || is_page_dirty(entry) || entry->addr & ENTRY_COW)
+        return false;
+
+    if (is_page_accessed(entry))
+    {
+        entry_rm_flag(entry, ENTRY_PAGE_ACCESSED);
+        /* the TLB entry would never set it again */
+        invlpg(va);
+        return false;
+    }
+
+    page = pa_to_page(entry->addr & ENTRY_FRAME_ADDR);
+    if (!page || page->count != 1 ||
+        page->flags & (PAGE_PINNED | PAGE_LOCKED | PAGE_SLAB))
+        return false;
+
+    entry->addr = 0;
+    invlpg(va);
+    pmm_free_order((void *) page_to_pa(page), 0);
+
+    return true;
+}
+
+/*
+ * Clock scan over the pages of areas backed on the first touch,
+ * in the current user space and in the kernel's, until `pages`
+ * frames are released or `scan` pages are looked at.
+ * Every step looks the area up again with interrupts disabled,
+ * since the area might be gone or reused by then.
+ * The hand goes around at most twice, which is enough for every
+ * page to lose its second chance.
+ * Returns the count of frames released.
+ */
+size_t vmm_reclaim(size_t pages, size_t scan)
+{
+    struct va_space *vs;
+    addr_t start, end;
+    size_t area_pages, freed = 0;
+    unsigned int flags;
+    bool wrapped = false;
+
+    while (freed < pages && scan)
+    {
+        flags = x86_irq_save();
+
+        vs = va_to_space(reclaim_hand);
+        start = vma_find(vs, reclaim_hand, &area_pages);
+        if (!start)
+        {
+            /* the end of user space or of the kernel's */
+            if (reclaim_hand < KRNL_VA_BASE)
+                reclaim_hand = KRNL_VA_BASE;
+            else if (wrapped)
+            {
+                x86_irq_restore(flags);
+                break;
+            }
+            else
+            {
+                reclaim_hand = USR_VA_BASE;
+                wrapped = true;
+            }
+        }
+        else
+        {
+            end = start + area_pages * PAGE_SIZE;
+            reclaim_hand = MAX(reclaim_hand, start);
+            if (!is_present(va_to_pde(reclaim_hand)))
+                /* no page table - nothing mapped up to its end */
+                reclaim_hand = MIN(end, (va_to_pt_idx(reclaim_hand) + 1) *
+                                        LARGE_PAGE_SIZE);
+            else
+            {
+                if (evict_page(reclaim_hand))
+                    freed++;
+                reclaim_hand += PAGE_SIZE;
+            }
+            scan--;
+        }
+
+        x86_irq_restore(flags);
+    }
+
+    return freed;
+}
+
 /*
  * Frees previously allocated memory chunk.
+ * Slab objects go back to their size class, anything else is
+ * a reserved area which knows its length.
  */
 void free(void *ptr)
 {
-    size_t b = get_mark_size(ptr);
+    struct page *page;
+    size_t pg_count;
 
-    if (!b)
+    if (!ptr)
         return;
 
-    ptr = unmark_size(ptr);
-    dealloc_bytes(ptr, b);
+    page = va_to_page(ptr);
+    if (page && (page->flags & PAGE_SLAB))
+    {
+        kmem_free(ptr);
+        return;
+    }
+
+    pg_count = vma_del(va_to_space((addr_t) ptr), (addr_t) ptr);
+    if (pg_count)
+        dealloc_bytes(ptr, pg_count * PAGE_SIZE);
 }
 
 /*
@@ -581,15 +999,12 @@ void free(void *ptr)
  */
 void *kalloc(size_t bytes)
 {
-    void *va;
-
-    bytes += MEM_MARK_SIZE;
-    va = alloc_bytes(vmm.cur_pd, bytes + MEM_MARK_SIZE, MEM_KRNL);
-    if (!va)
+    if (!bytes)
         return 0;
-    va = mark_size(va, bytes);
+    if (bytes <= KMALLOC_MAX_SIZE)
+        return kmem_alloc(bytes);
 
-    return va;
+    return alloc_large(bytes, MEM_KRNL);
 }
 
 /*
@@ -597,15 +1012,475 @@ void *kalloc(size_t bytes)
  */
 void *malloc(size_t bytes)
 {
-    void *va;
+    if (!bytes)
+        return 0;
+
+    return alloc_large(bytes, MEM_USR);
+}
+
+/*
+ * Moves the mappings of `cnt` pages from `from` over to `to`,
+ * which has to be unmapped. Frames and entry flags stay as they are.
+ * Returns 0 on success.
+ */
+static int move_range(addr_t from, addr_t to, size_t cnt)
+{
+    bool krnl = from >= KRNL_VA_BASE;
+    union entry_t *src;
+    size_t i;
+
+    /* page tables first, so that nothing fails halfway */
+    for (i = 0; i < cnt; i++)
+        if (!is_present(va_to_pde(to + i * PAGE_SIZE)) &&
+            alloc_pt(to + i * PAGE_SIZE))
+            return -ENOMEM;
+
+    for (i = 0; i < cnt; i++, from += PAGE_SIZE, to += PAGE_SIZE)
+    {
+        if (!is_present(va_to_pde(from)))
+            continue;
+        src = va_to_pte(from);
+        if (!is_present(src))
+            continue;
+
+        *va_to_pte(to) = *src;
+        src->addr = 0;
+        if (cnt <= INVLPG_MAX)
+            invlpg(from);
+    }
+
+    if (cnt > INVLPG_MAX && krnl)
+        flush_tlb_global();
+    else if (cnt > INVLPG_MAX)
+        flush_tlb();
+
+    return 0;
+}
+
+/*
+ * Resizes `ptr` to `bytes`, see krealloc().
+ */
+static void *realloc_area(void *ptr, size_t bytes, enum mem_area area)
+{
+    struct va_space *vs;
+    struct page *page;
+    size_t old_pages, pages;
+    addr_t va = (addr_t) ptr;
+    addr_t new_va;
+    void *new;
+
+    if (!ptr)
+        return area == MEM_USR ? malloc(bytes) : kalloc(bytes);
+    if (!bytes)
+    {
+        free(ptr);
+        return NULL;
+    }
+
+    /* slab objects are small, so they are just copied */
+    page = va_to_page(ptr);
+    if (page && (page->flags & PAGE_SLAB))
+    {
+        if (bytes <= kmem_size(ptr))
+            return ptr;
+        new = (area == MEM_USR ? malloc(bytes) : kalloc(bytes));
+        if (!new)
+            return NULL;
+        memcpy(new, ptr, kmem_size(ptr));
+        kmem_free(ptr);
+        return new;
+    }
+
+    vs = va_to_space(va);
+    old_pages = vma_size(vs, va);
+    if (!old_pages)
+        return NULL;
+    pages = bytes_to_blocks(bytes);
+
+    if (pages <= old_pages)
+    {
+        if (pages < old_pages)
+        {
+            dealloc_bytes((void *) (va + pages * PAGE_SIZE),
+                          (old_pages - pages) * PAGE_SIZE);
+            vma_resize(vs, va, pages);
+        }
+        return ptr;
+    }
+
+    /* grow in place if the VA right after it is free */
+    if (!va_reserve(vs, va + old_pages * PAGE_SIZE, pages - old_pages))
+    {
+        vma_resize(vs, va, pages);
+        return ptr;
+    }
+
+    /* otherwise the frames move over to a bigger range */
+    new_va = va_alloc(vs, pages);
+    if (!new_va)
+        return NULL;
+    if (vma_add(vs, new_va, pages))
+    {
+        va_free(vs, new_va, pages);
+        return NULL;
+    }
+    if (move_range(va, new_va, old_pages))
+    {
+        vma_del(vs, new_va);
+        dealloc_bytes((void *) new_va, pages * PAGE_SIZE);
+        return NULL;
+    }
+
+    /* the old range has nothing mapped anymore, just its PTs may go */
+    vma_del(vs, va);
+    unmap_range(va, old_pages, false);
+    va_free(vs, va, old_pages);
+
+    return (void *) new_va;
+}
+
+/*
+ * Changes the size of kernel memory chunk `ptr` to `bytes`,
+ * keeping its content. Page sized chunks grow into the VA right
+ * after them if it's free, or have their frames remapped to a new VA,
+ * only slab objects get copied.
+ * Returns the new address of the chunk or NULL on error,
+ * in which case `ptr` is left untouched.
+ */
+void *krealloc(void *ptr, size_t bytes)
+{
+    return realloc_area(ptr, bytes, MEM_KRNL);
+}
+
+/*
+ * Changes the size of user space memory chunk `ptr` to `bytes`,
+ * see krealloc().
+ */
+void *realloc(void *ptr, size_t bytes)
+{
+    return realloc_area(ptr, bytes, MEM_USR);
+}
+
+/*
+ * Maps `bytes` of physical memory starting at `pa` to kernel space.
+ * RAM is normally reached through phys_to_virt(), this is for
+ * whatever lies beyond the direct map.
+ * Returns a VA of `pa` or 0 on error.
+ */
+void *vmm_map_phys(addr_t pa, size_t bytes)
+{
+    size_t i;
+    size_t offset = pa % PAGE_SIZE;
+    size_t pg_count = bytes_to_blocks(bytes + offset);
+    addr_t va;
 
-    bytes += MEM_MARK_SIZE;
-    va = alloc_bytes(vmm.cur_pd, bytes, MEM_USR);
+    va = va_alloc(&va_space_krnl, pg_count);
     if (!va)
         return 0;
-    va = mark_size(va, bytes);
 
-    return va;
+    /* kernel's page tables are always present, so this can't fail */
+    for (i = 0; i < pg_count; i++)
+        map_page(va + (i * PAGE_SIZE), pa - offset + (i * PAGE_SIZE));
+
+    return (void *) (va + offset);
+}
+
+/*
+ * Unmaps a range mapped with vmm_map_phys().
+ * The physical memory itself is left alone.
+ */
+void vmm_unmap_phys(void *va, size_t bytes)
+{
+    size_t offset = (addr_t) va % PAGE_SIZE;
+    size_t pg_count = bytes_to_blocks(bytes + offset);
+    addr_t start = (addr_t) va - offset;
+
+    unmap_range(start, pg_count, false);
+    va_free(&va_space_krnl, start, pg_count);
+}
+
+/*
+ * Creates a new address space.
+ * Its user part is empty, while the low 1MB identity map and kernel's
+ * page tables are shared with every other address space by pointing
+ * PDEs at the very same tables. The last PDE maps the PD itself.
+ * Returns NULL on error.
+ */
+struct pd_t *vmm_space_create()
+{
+    struct pd_t *pd;
+    void *frame;
+    addr_t *pd_va;
+    addr_t *cur = (addr_t *) PD_MAP_VA;
+
+    pd = (struct pd_t *) kalloc(sizeof(struct pd_t));
+    if (!pd)
+        return NULL;
+    memset(pd, 0, sizeof(struct pd_t));
+
+    frame = pmm_alloc_page(PMM_ZERO);
+    if (!frame)
+        goto fail_pd;
+    pd->pd_pa = (addr_t) frame;
+    if (va_space_init(&pd->usr_va, USR_VA_BASE, USR_VA_END))
+        goto fail_frame;
+    pd_va = (addr_t *) map_frame((addr_t) frame);
+    if (!pd_va)
+        goto fail_va;
+
+    /* kernel's PDEs are the same in every PD, so any will do */
+    pd_va[0] = cur[0];
+    memcpy(&pd_va[KRNL_PT_IDX], &cur[KRNL_PT_IDX],
+           (SELF_MAP_PDE_IDX - KRNL_PT_IDX) * sizeof(addr_t));
+    pd_va[SELF_MAP_PDE_IDX] = pd->pd_pa | ENTRY_PRESENT | ENTRY_RW;
+    unmap_frame(pd_va);
+
+    /* link it after the kernel's own PD */
+    pd->prev = &vmm.bios_pd;
+    pd->next = vmm.bios_pd.next;
+    vmm.bios_pd.next->prev = pd;
+    vmm.bios_pd.next = pd;
+    vmm.pd_count++;
+
+    return pd;
+
+fail_va:
+    va_space_destroy(&pd->usr_va);
+fail_frame:
+    pmm_free_order(frame, 0);
+fail_pd:
+    free(pd);
+    return NULL;
+}
+
+/*
+ * Shares the user part of the current page table `table` with `child`
+ * by copying its entries into `child_table`. Writable pages become
+ * copy-on-write on both sides, every shared frame gains a reference.
+ * Returns 0 on success.
+ */
+static int clone_pt(union entry_t *table, union entry_t *child_table)
+{
+    union entry_t *entry;
+    struct page *page;
+    size_t i;
+
+    for (i = 0; i < PT_ENTRY_CNT; i++)
+    {
+        entry = &table[i];
+        if (!is_present(entry))
+            continue;
+
+        page = pa_to_page(entry->addr & ENTRY_FRAME_ADDR);
+        if (page && page_get(page) < 0)
+            return -ENOMEM;
+        if (is_rw(entry))
+        {
+            entry_rm_flag(entry, ENTRY_RW);
+            entry_add_flag(entry, ENTRY_COW);
+        }
+        child_table[i] = *entry;
+    }
+
+    return 0;
+}
+
+/*
+ * Creates a copy of the current address space.
+ * No user memory is copied, both spaces share every frame and
+ * the first write on either side copies just the page written to.
+ * Returns NULL on error.
+ */
+struct pd_t *vmm_space_clone()
+{
+    struct pd_t *child;
+    addr_t *child_pd;
+    union entry_t *child_table;
+    void *frame;
+    addr_t va;
+    size_t i;
+    int err = 0;
+
+    child = vmm_space_create();
+    if (!child)
+        return NULL;
+    va_space_destroy(&child->usr_va);
+    if (va_space_clone(&child->usr_va, &vmm.cur_pd->usr_va))
+        goto fail;
+    child_pd = (addr_t *) map_frame(child->pd_pa);
+    if (!child_pd)
+        goto fail;
+
+    for (i = va_to_pt_idx(USR_VA_BASE); i < KRNL_PT_IDX && !err; i++)
+    {
+        va = i * LARGE_PAGE_SIZE;
+        if (!is_present(va_to_pde(va)))
+            continue;
+
+        frame = pmm_alloc_page(PMM_ZERO);
+        if (!frame || !(child_table = (union entry_t *) map_frame((addr_t) frame)))
+        {
+            if (frame)
+                pmm_free_order(frame, 0);
+            err = -ENOMEM;
+            break;
+        }
+        err = clone_pt(va_to_pt(va), child_table);
+        unmap_frame(child_table);
+        child_pd[i] = (addr_t) frame | ENTRY_PRESENT | ENTRY_RW;
+    }
+    unmap_frame(child_pd);
+
+    /* parent's writable pages have just become read-only */
+    flush_tlb();
+    if (err)
+        goto fail;
+
+    return child;
+
+fail:
+    vmm_space_destroy(child);
+    return NULL;
+}
+
+/*
+ * Destroys an address space with all its user memory.
+ * Neither the current nor the kernel's own address space can go.
+ * Page tables are only reachable through the self map of the current
+ * space, so it is switched to for the time of the teardown.
+ */
+int vmm_space_destroy(struct pd_t *pd)
+{
+    struct pd_t *cur = vmm.cur_pd;
+
+    if (!pd || pd == &vmm.bios_pd || pd == vmm.cur_pd)
+        return -EBADARG;
+
+    load_pd(pd);
+    unmap_range(USR_VA_BASE, (USR_VA_END - USR_VA_BASE) / PAGE_SIZE, true);
+    load_pd(cur);
+    va_space_destroy(&pd->usr_va);
+
+    pmm_free_order((void *) pd->pd_pa, 0);
+
+    pd->prev->next = pd->next;
+    pd->next->prev = pd->prev;
+    vmm.pd_count--;
+    free(pd);
+
+    return 0;
+}
+
+/*
+ * Makes `pd` the current address space.
+ */
+int vmm_space_switch(struct pd_t *pd)
+{
+    if (!pd)
+        return -EBADARG;
+
+    load_pd(pd);
+
+    return 0;
+}
+
+/*
+ * Returns the current address space.
+ */
+struct pd_t *vmm_space_current()
+{
+    return vmm.cur_pd;
+}
+
+/*
+ * Turns global kernel mappings on or off. Kernel's entries keep
+ * their G bit either way, it is just ignored while CR4.PGE is clear.
+ * Returns -EFAULT if the CPU has no global pages.
+ */
+int vmm_set_global_pages(bool enable)
+{
+    if (!vmm.global_pages)
+        return -EFAULT;
+
+    /* either way all global entries are flushed */
+    if (enable)
+        cr4_set(CR4_PGE);
+    else
+        cr4_clear(CR4_PGE);
+    vmm.global_on = enable;
+
+    return 0;
+}
+
+/*
+ * Allocates `cnt` pages in kernel space.
+ * Unlike kalloc() the memory is page aligned and carries no size mark,
+ * so it has to be released with vmm_free_pages().
+ * Returns 0 on error.
+ */
+void *vmm_alloc_pages(size_t cnt)
+{
+    return alloc_bytes(cnt * PAGE_SIZE, MEM_KRNL);
+}
+
+/*
+ * Releases `cnt` pages allocated with vmm_alloc_pages().
+ */
+int vmm_free_pages(void *va, size_t cnt)
+{
+    return dealloc_bytes(va, cnt * PAGE_SIZE);
+}
+
+/*
+ * Returns the direct map VA of physical address `pa`
+ * or NULL if `pa` is beyond the direct map.
+ */
+void *phys_to_virt(addr_t pa)
+{
+    if (pa >= vmm.direct_map_bytes)
+        return NULL;
+
+    return (void *) (DIRECT_MAP_VA_BASE + pa);
+}
+
+/*
+ * Returns the physical address of a direct map or kernel image `va`,
+ * no page tables are looked at. Returns 0 for any other VA.
+ */
+addr_t virt_to_phys(void *va)
+{
+    addr_t addr = (addr_t) va;
+
+    if (addr >= DIRECT_MAP_VA_BASE &&
+        addr - DIRECT_MAP_VA_BASE < vmm.direct_map_bytes)
+        return addr - DIRECT_MAP_VA_BASE;
+    if (addr >= KRNL_VA_BASE && addr < KRNL_HEAP_VA_BASE)
+        return krnl_va_to_pa(addr);
+
+    return 0;
+}
+
+/*
+ * Returns the physical address `va` is mapped to or 0 if it isn't mapped.
+ */
+addr_t vmm_va_to_pa(void *va)
+{
+    union entry_t *pde = va_to_pde((addr_t) va);
+    union entry_t *entry;
+    addr_t pa = virt_to_phys(va);
+
+    if (pa)
+        return pa;
+    if (!is_present(pde))
+        return 0;
+    if (pde->flag & ENTRY_LARGE_PAGE)
+        return (pde->addr & ~(LARGE_PAGE_SIZE - 1)) +
+               ((addr_t) va % LARGE_PAGE_SIZE);
+    entry = va_to_pte((addr_t) va);
+    if (!is_present(entry))
+        return 0;
+
+    return (entry->addr & ENTRY_FRAME_ADDR) + ((addr_t) va % PAGE_SIZE);
 }
 
 void enable_paging()
@@ -0,0 +1,80 @@
+/******************************************************************************
+ *      Deferred work
+ *
+ *      A FIFO of work items. Items are queued from any context with
+ *      interrupts held off for the few instructions it takes, and run
+ *      by run_work() with interrupts enabled, so a slow item doesn't
+ *      hold back other IRQs.
+ ******************************************************************************/
+
+#include <x86/cpu.h>
+#include "workqueue.h"
+
+static struct {
+    struct work_t *head;
+    struct work_t *tail;
+    bool draining;  /* run_work() is somewhere down the stack */
+} queue;
+
+/*
+ * Queues `work` to be run by run_work().
+ * Does nothing if it's queued already.
+ */
+void queue_work(struct work_t *work)
+{
+    unsigned int flags = x86_irq_save();
+
+    if (!work->queued)
+    {
+        work->queued = true;
+        work->next = NULL;
+        if (queue.tail)
+            queue.tail->next = work;
+        else
+            queue.head = work;
+        queue.tail = work;
+    }
+
+    x86_irq_restore(flags);
+}
+
+/*
+ * Runs queued work until the queue is empty.
+ * Has to be called with interrupts enabled and outside of any
+ * allocator, the idle loop is the place for it. Work queued while
+ * the queue is being drained runs in the same call.
+ */
+void run_work()
+{
+    struct work_t *work;
+    unsigned int flags = x86_irq_save();
+
+    if (queue.draining)
+        goto out;
+    queue.draining = true;
+
+    while ((work = queue.head))
+    {
+        queue.head = work->next;
+        if (!queue.head)
+            queue.tail = NULL;
+        /* it can be queued again while it runs */
+        work->queued = false;
+
+        x86_irq_restore(flags);
+        work->func(work->data);
+        flags = x86_irq_save();
+    }
+
+    queue.draining = false;
+out:
+    x86_irq_restore(flags);
+}
+
+/*
+ * Returns true if there is work waiting to be run.
+ */
+bool work_pending()
+{
+    return queue.head != NULL;
+}
@@ -0,0 +1,35 @@
+/******************************************************************************
+ *      Deferred work
+ *
+ *      Interrupt handlers queue work items instead of doing the work
+ *      themselves. The queue is drained with interrupts enabled from
+ *      the idle loop, never on the way out of an IRQ, since work may
+ *      allocate and the interrupted code might be in the middle of it.
+ ******************************************************************************/
+
+#ifndef WORKQUEUE_Q3N8ZKX2
+#define WORKQUEUE_Q3N8ZKX2
+
+#include <libc.h>
+
+typedef void work_func_t(void *);
+
+/*
+ * A work item is owned by whoever queues it, so queueing never
+ * allocates. An item queued again before it ran runs only once.
+ */
+struct work_t {
+    struct work_t *next;
+    work_func_t *func;
+    void *data;
+    bool queued;
+};
+
+#define WORK_INIT(func, data)   \
+    { NULL, (func), (data), false }
+
+void queue_work(struct work_t *work);
+void run_work();
+bool work_pending();
+
+#endif /* end of include guard: WORKQUEUE_Q3N8ZKX2 */
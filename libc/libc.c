@@ -83,8 +83,18 @@ void color_load()
  */
 void *memset(void *dest, int val, size_t count)
 {
+    unsigned char *p = dest;
+    unsigned int word = (unsigned char) val * 0x01010101U;
+
+    while (count > 0 && ((unsigned int) p & (sizeof(word) - 1)))
+    {
+        *p++ = val;
+        count--;
+    }
+    for (; count >= sizeof(word); count -= sizeof(word), p += sizeof(word))
+        *(unsigned int *) p = word;
     while (count-- > 0)
-        ((unsigned char *) dest)[count] = val;
+        *p++ = val;
     return dest;
 }
 
@@ -11,6 +11,8 @@
 #include "cpu.h"
 #include "dma.h"
 
+#define EFLAGS_ID 0x200000
+
 /* CPU exception handlers defined in irq.asm */
 extern void x86_divide_handle();
 extern void x86_single_step_debug_handle();
@@ -158,6 +160,77 @@ void outportb (unsigned short _port, unsigned char _data)
     __asm__ __volatile__ ("outb %1, %0" : : "dN" (_port), "a" (_data));
 }
 
+/*
+ * Returns CPUID feature flags (EDX of leaf 1)
+ * or 0 if the CPU has no CPUID instruction at all.
+ */
+unsigned int x86_cpu_features()
+{
+    unsigned int eflags, toggled;
+    unsigned int eax, ebx, ecx, edx;
+
+    /* CPUID is supported if EFLAGS.ID can be flipped */
+    __asm__ __volatile__("pushfl \n"
+                         "popl %0 \n"
+                         "movl %0, %1 \n"
+                         "xorl %2, %1 \n"
+                         "pushl %1 \n"
+                         "popfl \n"
+                         "pushfl \n"
+                         "popl %1 \n"
+                         "pushl %0 \n"
+                         "popfl \n"
+                    : "=&r" (eflags), "=&r" (toggled)
+                    : "i" (EFLAGS_ID)
+                    : "cc");
+    if (!((eflags ^ toggled) & EFLAGS_ID))
+        return 0;
+
+    __asm__ __volatile__("cpuid"
+                    : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+                    : "a" (1));
+
+    return edx;
+}
+
+/*
+ * Returns CPU's time stamp counter.
+ * Check X86_FEATURE_TSC before relying on it.
+ */
+unsigned long long x86_rdtsc()
+{
+    unsigned long long tsc;
+
+    __asm__ __volatile__("rdtsc" : "=A" (tsc));
+
+    return tsc;
+}
+
+/*
+ * Disables interrupts and returns the previous EFLAGS,
+ * so the caller can restore whatever state it was called in.
+ */
+unsigned int x86_irq_save()
+{
+    unsigned int flags;
+
+    __asm__ __volatile__ ("pushfl\n"
+                          "popl %0\n"
+                          "cli\n"
+                        : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/*
+ * Restores the interrupt flag saved by x86_irq_save().
+ */
+void x86_irq_restore(unsigned int flags)
+{
+    __asm__ __volatile__ ("pushl %0\n"
+                          "popfl\n"
+                        : : "r"(flags) : "memory", "cc");
+}
+
 /*
  * Hals the CPU.
  */
@@ -47,9 +47,18 @@ struct x86_seg_reg_t {
 #define X86_PAGE_FAULT_IRQ 14
 #define X86_COPROC_IRQ 16
 
+/* CPUID leaf 1 EDX feature flags */
+#define X86_FEATURE_PSE (1 << 3)    /* 4MB pages */
+#define X86_FEATURE_TSC (1 << 4)    /* RDTSC */
+#define X86_FEATURE_PGE (1 << 13)   /* global pages */
+
 int x86_init();
 inline void x86_cpu_halt();
 inline int x86_dump_registers();
+unsigned int x86_cpu_features();
+unsigned long long x86_rdtsc();
+unsigned int x86_irq_save();
+void x86_irq_restore(unsigned int flags);
 unsigned char inportb (unsigned short _port);
 void outportb (unsigned short _port, unsigned char _data);
 
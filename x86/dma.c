@@ -114,8 +114,6 @@ enum dma_mode
     DMA_MODE_CASCADE = 0xC0
 };
 
-static const unsigned int DMA_BUFFER_START = 0x1000;
-
 #define channel_to_dma(CHAN)  \
     ((CHAN) <= 3 && (CHAN) >= 0 ? (DMA_MASTER) : (DMA_SLAVE))
 
@@ -132,10 +130,14 @@ int dma_struct_init(struct dma_t *dma, unsigned char channel)
 
     dma->channel = channel;
     dma->_dma = channel_to_dma(channel);
+    /* the buffer is allocated when the channel gets registered */
+    dma->buf = 0;
+    dma->buf_va = NULL;
+    dma->buf_alloc_sz = 0;
     if (dma->_dma == DMA_MASTER)
     {
-        dma->max_buf_sz = MASTER_MAX_COUNT;
-        dma->buf = DMA_BUFFER_START + (dma->channel * dma->max_buf_sz);
+        /* the buffer can't cross 64KB, neither can the transfer */
+        dma->max_buf_sz = MIN(MASTER_MAX_COUNT, ZONE_DMA_BOUNDARY);
         dma->cmd_reg = DMA0_CMD_REG;
         dma->flipflop_reg = DMA0_FLIPFLOP_REG;
         dma->interm_reg = DMA0_INTERM_REG;
@@ -149,7 +151,6 @@ int dma_struct_init(struct dma_t *dma, unsigned char channel)
     else if (dma->_dma == DMA_SLAVE)
     {
         dma->max_buf_sz = SLAVE_MAX_COUNT;
-        dma->buf = DMA_BUFFER_START + (dma->channel * dma->max_buf_sz);
         dma->cmd_reg = DMA1_CMD_REG;
         dma->flipflop_reg = DMA1_FLIPFLOP_REG;
         dma->interm_reg = DMA1_INTERM_REG;
@@ -232,6 +233,8 @@ static int dma_set_page(struct dma_t *dma, addr_t addr)
 
     dma_clear_ff(dma);
     outportb(dma->page_reg, (addr >> 16) & 0xFF);
+
+    return 0;
 }
 
 static int dma_set_addr(struct dma_t *dma, addr_t addr)
@@ -252,7 +255,7 @@ static int dma_set_cnt(struct dma_t *dma, size_t cnt)
 {
     if (cnt < 1)
         return -ESIZE;
-    if (cnt >= dma->max_buf_sz)
+    if (cnt > dma->max_buf_sz)
         return -ESIZE;
 
     /* count always will be 1 more than requested.
@@ -262,6 +265,40 @@ static int dma_set_cnt(struct dma_t *dma, size_t cnt)
     dma_clear_ff(dma);
     outportb(dma->cnt_reg, dma->buf_sz & 0xFF);
     outportb(dma->cnt_reg, (dma->buf_sz >> 8) & 0xFF);
+
+    return 0;
+}
+
+/*
+ * Allocates a DMA reachable buffer of `cnt` bytes for the channel.
+ * ZONE_DMA is always in the direct map, so the CPU sees it there.
+ * The previous buffer is freed once the channel is stopped.
+ */
+static int dma_alloc_buf(struct dma_t *dma, size_t cnt)
+{
+    void *buf, *buf_va;
+
+    buf = pmm_alloc_dma(cnt);
+    if (!buf)
+        return -ENOMEM;
+
+    buf_va = phys_to_virt((addr_t) buf);
+    if (!buf_va)
+    {
+        pmm_dealloc((addr_t) buf, cnt);
+        return -ENOMEM;
+    }
+
+    if (dma->buf)
+    {
+        dma_disable_channel(dma);
+        pmm_dealloc(dma->buf, dma->buf_alloc_sz);
+    }
+    dma->buf = (addr_t) buf;
+    dma->buf_va = buf_va;
+    dma->buf_alloc_sz = cnt;
+
+    return 0;
 }
 
 /*
@@ -273,12 +310,20 @@ int dma_reg_channel(struct dma_t *dma, size_t cnt)
 {
     if (!dma)
         return -EBADARG;
+    if (cnt < 1 || cnt > dma->max_buf_sz)
+        return -ESIZE;
+
+    /* the buffer only grows, a shorter transfer reuses it */
+    if (cnt > dma->buf_alloc_sz && dma_alloc_buf(dma, cnt))
+        return -ENOMEM;
 
     /* Keep the channel disabled while re-programming it */
     dma_disable_channel(dma);
     dma_set_addr(dma, dma->buf);
     dma_set_cnt(dma, cnt);
     dma_enable_channel(dma);
+
+    return 0;
 }
 
 /*
@@ -22,8 +22,10 @@ struct dma_t
 {
     enum dma _dma;
     unsigned char channel;
-    addr_t buf;
+    addr_t buf;     /* physical address the controller works with */
+    void *buf_va;   /* the same buffer as seen by the CPU */
     addr_t buf_sz;
+    size_t buf_alloc_sz;    /* bytes allocated for `buf` */
     size_t max_buf_sz;
     unsigned char status_reg;
     unsigned char addr_reg;
@@ -4,6 +4,8 @@
  *          Author: Arvydas Sidorenko
  ******************************************************************************/
 
+#include <libc.h>
+#include <mm.h>
 #include "cpu.h"
 
 extern void kernel_panic(char *msg);
@@ -147,13 +149,21 @@ void x86_gpf_except()
 
 /*
  * Page translation exception.
+ * CR2 holds the faulting address, `err` is the error code pushed by CPU.
+ * Reserved memory is backed on the first touch, anything else is fatal.
  * IRQ: 14
  */
-void x86_page_fault_except()
+void x86_page_fault_except(unsigned int err)
 {
-    __asm__ __volatile__("movl %%cr2, %%eax" : : : "eax");
-    
-    kernel_panic("page fault ");
+    addr_t va;
+
+    __asm__ __volatile__("movl %%cr2, %0" : "=r" (va));
+
+    if (vmm_page_fault(va, err))
+    {
+        printf("page fault at 0x%x, error code 0x%x\n", va, err);
+        kernel_panic("page fault");
+    }
 }
 
 /* IRQ 15 is reserved */
@@ -7,6 +7,7 @@
 #include <libc.h>
 #include <time.h>
 #include <callback.h>
+#include <workqueue.h>
 #include "cpu.h"
 #include "i8253.h"
 #include "i8259.h"
@@ -36,16 +37,21 @@ static unsigned int pit_mod(unsigned long long jiffy, unsigned int mod_val)
 }
 
 /*
- * PIT IRQ0 interrupt handler
+ * Dynamic tick state.
+ * While idle, the periodic tick is stopped and channel 0 counts down
+ * once to the next callback deadline. `oneshot_cnt` is the count it
+ * was programmed with, 0 when it's ticking periodically.
+ * `carry` holds PIT counts which didn't add up to a whole jiffy yet.
+ * `stale_irq` is set if the one-shot IRQ is pending, but its time
+ * is accounted for already.
  */
-void x86_i8253_irq_do_handle()
-{
-    pit_jiffy++;
-    update_clock_pit(PIT_HZ);
-    check_callbacks();
+static unsigned int oneshot_cnt = 0;
+static unsigned int carry = 0;
+static bool stale_irq = false;
 
-    irq_done(IRQ0_VECTOR);
-}
+static void run_callbacks(void *data);
+/* callbacks run out of the IRQ */
+static struct work_t callback_work = WORK_INIT(run_callbacks, NULL);
 
 static inline void i8253_set_frequency()
 {
@@ -53,12 +59,162 @@ static inline void i8253_set_frequency()
     outportb(PIT_PORT_PIT_0, (PIT_FREQ >> 8) & 0xFF);
 }
 
-int i8253_init()
+/*
+ * Puts channel 0 back into the periodic PIT_HZ mode.
+ */
+static void i8253_set_periodic()
 {
-    outportb(PIT_PORT_MODE, PIT_CTRL_BCD_DEC |
+    outportb(PIT_PORT_MODE, PIT_CTRL_BCD_BIN |
                             PIT_CTRL_MODE_SQR_WAVE |
                             PIT_CTRL_RL_LEAST_MOST_SIG |
                             PIT_CTRL_SELECT_0);
     i8253_set_frequency();
+}
+
+/*
+ * Makes channel 0 raise IRQ0 once, after `cnt` PIT counts.
+ * PIT_CTRL_MODE_ONE_SHOT is triggered by the gate, which is tied
+ * high on channel 0, so interrupt on terminal count is used instead.
+ */
+static void i8253_set_oneshot(unsigned int cnt)
+{
+    outportb(PIT_PORT_MODE, PIT_CTRL_BCD_BIN |
+                            PIT_CTRL_MODE_ON_TERM_CNT |
+                            PIT_CTRL_RL_LEAST_MOST_SIG |
+                            PIT_CTRL_SELECT_0);
+    outportb(PIT_PORT_PIT_0, cnt & 0xFF);
+    outportb(PIT_PORT_PIT_0, (cnt >> 8) & 0xFF);
+}
+
+/*
+ * Returns the current count of channel 0.
+ * `expired` is set if its OUT pin went up, that is the one-shot
+ * reached terminal count and the count already wrapped past 0.
+ */
+static unsigned int i8253_read_count(bool *expired)
+{
+    unsigned int cnt, status;
+
+    outportb(PIT_PORT_MODE, PIT_CTRL_READ_BACK | PIT_READ_BACK_0);
+    status = inportb(PIT_PORT_PIT_0);
+    cnt = inportb(PIT_PORT_PIT_0);
+    cnt |= inportb(PIT_PORT_PIT_0) << 8;
+    *expired = status & PIT_STATUS_OUT;
+
+    return cnt;
+}
+
+/*
+ * Advances the jiffies and the clock by `cnt` PIT counts.
+ */
+static void i8253_account(unsigned int cnt)
+{
+    cnt += carry;
+    carry = cnt % PIT_FREQ;
+    for (cnt /= PIT_FREQ; cnt > 0; cnt--)
+    {
+        pit_jiffy++;
+        update_clock_pit(PIT_HZ);
+    }
+}
+
+static void run_callbacks(void *data)
+{
+    (void) data;
+    check_callbacks();
+}
+
+/*
+ * PIT IRQ0 interrupt handler
+ */
+void x86_i8253_irq_do_handle()
+{
+    if (stale_irq)
+        stale_irq = false;
+    else if (oneshot_cnt)
+    {
+        /* woke up from the idle - the whole one-shot has passed */
+        i8253_account(oneshot_cnt);
+        oneshot_cnt = 0;
+        i8253_set_periodic();
+    }
+    else
+    {
+        pit_jiffy++;
+        update_clock_pit(PIT_HZ);
+    }
+    queue_work(&callback_work);
+
+    irq_done(IRQ0_VECTOR);
+}
+
+/*
+ * Halts the CPU until the next interrupt with the periodic tick
+ * stopped. The PIT is set to fire once, when the next callback is
+ * due, and the time that passed is caught up on the wakeup.
+ * A one-shot can't be longer than PIT_MAX_COUNT, so an idle CPU
+ * still wakes up every 55ms.
+ */
+void i8253_idle()
+{
+    milis_t when, now, ms;
+    unsigned int cnt, left;
+    bool expired;
+
+    irq_disable();
+
+    /* an IRQ queued work after the idle loop ran it */
+    if (work_pending())
+    {
+        irq_enable();
+        return;
+    }
+
+    now = get_uptime_milis();
+    if (!callback_next_event(&when))
+        cnt = PIT_MAX_COUNT;
+    else if ((long) (when - now) > 1)
+    {
+        ms = MIN(when - now, PIT_MAX_COUNT / PIT_FREQ + 1);
+        cnt = MIN(ms * PIT_FREQ - carry, PIT_MAX_COUNT);
+    }
+    else
+        cnt = 0;    /* due on the next tick anyway */
+
+    if (cnt)
+    {
+        oneshot_cnt = cnt;
+        i8253_set_oneshot(cnt);
+    }
+
+    /* sti holds interrupts off until after hlt */
+    __asm__ __volatile__ ("sti\n"
+                          "hlt\n"
+                          "cli\n"
+                        : : : "memory");
+
+    /* woken up by something else than the PIT */
+    if (oneshot_cnt)
+    {
+        left = i8253_read_count(&expired);
+        /* it expired while interrupts were off, the count tells nothing
+         * after the wrap - even a programmed PIT_MAX_COUNT wraps to itself */
+        if (expired || !left)
+        {
+            left = 0;
+            stale_irq = true;
+        }
+        i8253_account(oneshot_cnt - left);
+        oneshot_cnt = 0;
+        i8253_set_periodic();
+        queue_work(&callback_work);
+    }
+
+    irq_enable();
+}
+
+int i8253_init()
+{
+    i8253_set_periodic();
     return 0;
 }
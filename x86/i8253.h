@@ -13,6 +13,7 @@ extern unsigned long long pit_jiffy;
 #define PIT_HZ 1000
 #define PIT_CLOCK_TICK 1193181
 #define PIT_FREQ    (PIT_CLOCK_TICK / PIT_HZ)
+#define PIT_MAX_COUNT 0xFFFF    /* the longest one-shot, about 55ms */
 
 /* Ports */
 #define PIT_PORT_BASE 0x40
@@ -32,6 +33,7 @@ extern unsigned long long pit_jiffy;
 #define PIT_CTRL_MODE_SOFT_TRIG 0x8 /* 00001000 */
 #define PIT_CTRL_MODE_HARD_TRIG 0xA /* 00001010 */
 /* 5-6th bit - RL (Read/Load) */
+#define PIT_CTRL_RL_LATCH          0x00 /* latch the count for reading */
 #define PIT_CTRL_RL_MOST_SIG       0x20 /* 00100000 */
 #define PIT_CTRL_RL_LEAST_SIG      0x10 /* 00010000 */
 #define PIT_CTRL_RL_LEAST_MOST_SIG 0x30 /* 00110000 */
@@ -39,7 +41,14 @@ extern unsigned long long pit_jiffy;
 #define PIT_CTRL_SELECT_0 0
 #define PIT_CTRL_SELECT_1 0x40 /* 01000000 */
 #define PIT_CTRL_SELECT_2 0x80 /* 10000000 */
+/* 8254 read-back command, latches status and count of the counters
+ * selected by bits 1-3 */
+#define PIT_CTRL_READ_BACK 0xC0     /* 11000000 */
+#define PIT_READ_BACK_0    0x02     /* 00000010 */
+/* read-back status byte */
+#define PIT_STATUS_OUT     0x80     /* OUT pin - set on terminal count */
 
 int i8253_init();
+void i8253_idle();
 
 #endif /* end of include guard: I8253_IA5WC1E3 */
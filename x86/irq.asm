@@ -104,8 +104,15 @@ x86_stack_handle:
 x86_gpf_handle:
     HANDLE x86_gpf_except
 
+; the CPU pushes an error code, which has to be gone before iret
 x86_page_fault_handle:
-    HANDLE x86_page_fault_except
+    pushad
+    push dword [esp + 32]
+    call x86_page_fault_except
+    add esp, 4
+    popad
+    add esp, 4
+    iret
 
 x86_coproc_handle:
     HANDLE x86_coproc_except